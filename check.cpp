@@ -11,105 +11,141 @@
 int main (int argc, char **argv)
 {
 	std::vector<node *> nodes, vias;
+	std::vector<size_t> found;
 	node *cur, *sub;
-	size_t i, j;
+	size_t i, j, k;
 
 	size_t metal2_start, metal2_end;
 	size_t metal1_start, metal1_end;
 	size_t poly_start, poly_end;
 	size_t diff_start, diff_end;
 
+	// Start reading every layer file up front, all at once, so they're ready by the time they're needed
+	static const char *const layer_files[] = {
+		"metal2_pwr.dat", "metal2_gnd.dat", "metal2.dat",
+		"metal1_pwr.dat", "metal1_gnd.dat", "metal1.dat",
+		"metal_pwr.dat", "metal_gnd.dat", "metal.dat",
+		"poly_pwr.dat", "poly_gnd.dat", "poly.dat",
+		"diff_pwr.dat", "diff_gnd.dat", "diff.dat",
+		"vias2.dat", "vias1.dat", "vias.dat", "buried.dat",
+		"trans_n.dat", "trans_p.dat", "trans.dat"
+	};
+	layer_loader loader(layer_files, sizeof(layer_files) / sizeof(layer_files[0]));
+
 	metal2_start = nodes.size();
-	readnodes<node>("metal2_pwr.dat", nodes, LAYER_METAL);
-	readnodes<node>("metal2_gnd.dat", nodes, LAYER_METAL);
-	readnodes<node>("metal2.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal2_pwr.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal2_gnd.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal2.dat", nodes, LAYER_METAL);
 	metal2_end = nodes.size();
 
 	metal1_start = nodes.size();
-	readnodes<node>("metal1_pwr.dat", nodes, LAYER_METAL);
-	readnodes<node>("metal1_gnd.dat", nodes, LAYER_METAL);
-	readnodes<node>("metal1.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal1_pwr.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal1_gnd.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal1.dat", nodes, LAYER_METAL);
 	// Single-metal NMOS compat
-	readnodes<node>("metal_pwr.dat", nodes, LAYER_METAL);
-	readnodes<node>("metal_gnd.dat", nodes, LAYER_METAL);
-	readnodes<node>("metal.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal_pwr.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal_gnd.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal.dat", nodes, LAYER_METAL);
 	metal1_end = nodes.size();
 
 	poly_start = nodes.size();
-	readnodes<node>("poly_pwr.dat", nodes, LAYER_POLY);
-	readnodes<node>("poly_gnd.dat", nodes, LAYER_POLY);
-	readnodes<node>("poly.dat", nodes, LAYER_POLY);
+	loader.read<node>("poly_pwr.dat", nodes, LAYER_POLY);
+	loader.read<node>("poly_gnd.dat", nodes, LAYER_POLY);
+	loader.read<node>("poly.dat", nodes, LAYER_POLY);
 	poly_end = nodes.size();
 
 	diff_start = nodes.size();
-	readnodes<node>("diff_pwr.dat", nodes, LAYER_DIFF);
-	readnodes<node>("diff_gnd.dat", nodes, LAYER_DIFF);
-	readnodes<node>("diff.dat", nodes, LAYER_DIFF);
+	loader.read<node>("diff_pwr.dat", nodes, LAYER_DIFF);
+	loader.read<node>("diff_gnd.dat", nodes, LAYER_DIFF);
+	loader.read<node>("diff.dat", nodes, LAYER_DIFF);
 	diff_end = nodes.size();
 
 	printf("Checking metal2 segments (%zi-%zi)\n", metal2_start, metal2_end - 1);
+	node_index metal2_index(nodes, metal2_start, metal2_end);
 	for (i = metal2_start; i < metal2_end; i++)
 	{
 		cur = nodes[i];
 		int area = cur->poly.area();
 		if (area < 16)
 			printf("Metal2 segment %zi (%s) is unusually small (%i)!\n", i, cur->poly.toString().c_str(), area);
-		for (j = i + 1; j < metal2_end; j++)
+		// only the segments near this one (and after it) need checking
+		metal2_index.find(cur->bbox, found);
+		for (k = 0; k < found.size(); k++)
 		{
+			j = found[k];
+			if (j <= i)
+				continue;
 			sub = nodes[j];
-			// Check collisions in both directions, in case one way fails
-			if (cur->collide(sub) || sub->collide(cur))
+			if (cur->collide(sub))
 				printf("Metal2 segments %zi (%s) and %zi (%s) collide!\n", i, cur->poly.toString().c_str(), j, sub->poly.toString().c_str());
 		}
 	}
 
 	printf("Checking metal1 segments (%zi-%zi)\n", metal1_start, metal1_end - 1);
+	node_index metal1_index(nodes, metal1_start, metal1_end);
 	for (i = metal1_start; i < metal1_end; i++)
 	{
 		cur = nodes[i];
 		int area = cur->poly.area();
 		if (area < 16)
 			printf("Metal1 segment %zi (%s) is unusually small (%i)!\n", i, cur->poly.toString().c_str(), area);
-		for (j = i + 1; j < metal1_end; j++)
+		// only the segments near this one (and after it) need checking
+		metal1_index.find(cur->bbox, found);
+		for (k = 0; k < found.size(); k++)
 		{
+			j = found[k];
+			if (j <= i)
+				continue;
 			sub = nodes[j];
-			// Check collisions in both directions, in case one way fails
-			if (cur->collide(sub) || sub->collide(cur))
+			if (cur->collide(sub))
 				printf("Metal1 segments %zi (%s) and %zi (%s) collide!\n", i, cur->poly.toString().c_str(), j, sub->poly.toString().c_str());
 		}
 	}
 
 	printf("Checking polysilicon segments (%zi-%zi)\n", poly_start, poly_end - 1);
+	node_index poly_index(nodes, poly_start, poly_end);
 	for (i = poly_start; i < poly_end; i++)
 	{
 		cur = nodes[i];
 		int area = cur->poly.area();
 		if (area < 16)
 			printf("Polysilicon segment %zi (%s) is unusually small (%i)!\n", i, cur->poly.toString().c_str(), area);
-		for (j = i + 1; j < poly_end; j++)
+		// only the segments near this one (and after it) need checking
+		poly_index.find(cur->bbox, found);
+		for (k = 0; k < found.size(); k++)
 		{
+			j = found[k];
+			if (j <= i)
+				continue;
 			sub = nodes[j];
-			if (cur->collide(sub) || sub->collide(cur))
+			if (cur->collide(sub))
 				printf("Polysilicon segments %zi (%s) and %zi (%s) collide!\n", i, cur->poly.toString().c_str(), j, sub->poly.toString().c_str());
 		}
 	}
 
 	printf("Checking diffusion segments (%zi-%zi)\n", diff_start, diff_end - 1);
+	node_index diff_index(nodes, diff_start, diff_end);
 	for (i = diff_start; i < diff_end; i++)
 	{
 		cur = nodes[i];
 		int area = cur->poly.area();
 		if (area < 16)
 			printf("Diffusion segment %zi (%s) is unusually small (%i)!\n", i, cur->poly.toString().c_str(), area);
-		for (j = i + 1; j < diff_end; j++)
+		// only the segments near this one (and after it) need checking
+		diff_index.find(cur->bbox, found);
+		for (k = 0; k < found.size(); k++)
 		{
+			j = found[k];
+			if (j <= i)
+				continue;
 			sub = nodes[j];
-			if (cur->collide(sub) || sub->collide(cur))
+			if (cur->collide(sub))
 				printf("Diffusion segments %zi (%s) and %zi (%s) collide!\n", i, cur->poly.toString().c_str(), j, sub->poly.toString().c_str());
 		}
 	}
 
-	readnodes<node>("vias2.dat", vias, LAYER_SPECIAL);
+	node_index metal_index(nodes, metal2_start, metal1_end);
+	loader.read<node>("vias2.dat", vias, LAYER_SPECIAL);
 	printf("Checking for bad vias2 (%zi total)\n", vias.size());
 	for (i = 0; i < vias.size(); i++)
 	{
@@ -118,10 +154,11 @@ int main (int argc, char **argv)
 		int area = sub->poly.area();
 		if (area < 9)
 			printf("Via2 %zi (%s) is unusually small (%i)!\n", i, sub->poly.toString().c_str(), area);
-		for (j = metal2_start; j < metal1_end; j++)
+		metal_index.find(sub->bbox, found);
+		for (k = 0; k < found.size(); k++)
 		{
-			cur = nodes[j];
-			if (cur->collide(sub) || sub->collide(cur))
+			cur = nodes[found[k]];
+			if (cur->collide(sub))
 				hits++;
 		}
 		if (hits != 2)
@@ -129,9 +166,10 @@ int main (int argc, char **argv)
 	}
 	vias.clear();
 
-	readnodes<node>("vias1.dat", vias, LAYER_SPECIAL);
+	node_index lower_index(nodes, metal1_start, diff_end);
+	loader.read<node>("vias1.dat", vias, LAYER_SPECIAL);
 	// Single-metal NMOS compat
-	readnodes<node>("vias.dat", vias, LAYER_SPECIAL);
+	loader.read<node>("vias.dat", vias, LAYER_SPECIAL);
 	printf("Checking for bad vias1 (%zi total)\n", vias.size());
 	for (i = 0; i < vias.size(); i++)
 	{
@@ -140,10 +178,11 @@ int main (int argc, char **argv)
 		int area = sub->poly.area();
 		if (area < 9)
 			printf("Via1 %zi (%s) is unusually small (%i)!\n", i, sub->poly.toString().c_str(), area);
-		for (j = metal1_start; j < diff_end; j++)
+		lower_index.find(sub->bbox, found);
+		for (k = 0; k < found.size(); k++)
 		{
-			cur = nodes[j];
-			if (cur->collide(sub) || sub->collide(cur))
+			cur = nodes[found[k]];
+			if (cur->collide(sub))
 				hits++;
 		}
 		if (hits != 2)
@@ -151,7 +190,8 @@ int main (int argc, char **argv)
 	}
 	vias.clear();
 
-	readnodes<node>("buried.dat", vias, LAYER_SPECIAL);
+	node_index silicon_index(nodes, poly_start, diff_end);
+	loader.read<node>("buried.dat", vias, LAYER_SPECIAL);
 	printf("Checking for bad buried contacts (%zi total)\n", vias.size());
 	for (i = 0; i < vias.size(); i++)
 	{
@@ -160,10 +200,11 @@ int main (int argc, char **argv)
 		int area = sub->poly.area();
 		if (area < 16)
 			printf("Buried contact %zi (%s) is unusually small (%i)!\n", i, sub->poly.toString().c_str(), area);
-		for (j = poly_start; j < diff_end; j++)
+		silicon_index.find(sub->bbox, found);
+		for (k = 0; k < found.size(); k++)
 		{
-			cur = nodes[j];
-			if (cur->collide(sub) || sub->collide(cur))
+			cur = nodes[found[k]];
+			if (cur->collide(sub))
 				hits++;
 		}
 		if (hits != 2)
@@ -171,10 +212,10 @@ int main (int argc, char **argv)
 	}
 	vias.clear();
 
-	readnodes<node>("trans_n.dat", vias, LAYER_SPECIAL);
-	readnodes<node>("trans_p.dat", vias, LAYER_SPECIAL);
+	loader.read<node>("trans_n.dat", vias, LAYER_SPECIAL);
+	loader.read<node>("trans_p.dat", vias, LAYER_SPECIAL);
 	// Single-metal NMOS compat
-	readnodes<node>("trans.dat", vias, LAYER_SPECIAL);
+	loader.read<node>("trans.dat", vias, LAYER_SPECIAL);
 	printf("Checking for bad transistors (%zi total)\n", vias.size());
 	for (i = 0; i < vias.size(); i++)
 	{
@@ -183,10 +224,11 @@ int main (int argc, char **argv)
 		int area = sub->poly.area();
 		if (area < 15)
 			printf("Transistor %zi (%s) is unusually small (%i)!\n", i, sub->poly.toString().c_str(), area);
-		for (j = poly_start; j < poly_end; j++)
+		poly_index.find(sub->bbox, found);
+		for (k = 0; k < found.size(); k++)
 		{
-			cur = nodes[j];
-			if (cur->collide(sub) || sub->collide(cur))
+			cur = nodes[found[k]];
+			if (cur->collide(sub))
 				hits++;
 		}
 		if (hits != 1)
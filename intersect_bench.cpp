@@ -0,0 +1,185 @@
+/*
+ * Segment Intersection Benchmark
+ * Times intersect() against the long double version it replaced, using the edges of a layer file,
+ * and makes sure the two of them always agree
+ *
+ * Copyright (c) QMT Productions
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "polygon.h"
+
+// Default number of segment pairs (and again of isInside() rays) to test
+#define DEFAULT_QUERIES	2000000
+// Each version is timed this many times, keeping the fastest run
+#define ROUNDS		5
+
+// intersect() as it was before it switched to integers
+// The cross products are widened before multiplying (rather than after), the same as the new version,
+// so coordinates too large for 32-bit products don't make the two of them disagree
+bool intersect_old (const vertex &p1, const vertex &p2, const vertex &q1, const vertex &q2)
+{
+	int64_t d = 2 * ((int64_t)(q2.y - q1.y) * (p2.x - p1.x) - (int64_t)(q2.x - q1.x) * (p2.y - p1.y));
+	if (d == 0)
+		return false;
+
+	int64_t _ua = (int64_t)(q2.x - q1.x) * (2 * (p1.y - q1.y) - 1) - (int64_t)(q2.y - q1.y) * (2 * (p1.x - q1.x) - 1);
+	int64_t _ub = (int64_t)(p2.x - p1.x) * (2 * (p1.y - q1.y) - 1) - (int64_t)(p2.y - p1.y) * (2 * (p1.x - q1.x) - 1);
+
+	long double ua = (long double)_ua / (long double)d;
+	long double ub = (long double)_ub / (long double)d;
+
+	// the two segments overlap - we should probably issue a warning if this happens, since it'll mess things up
+	if (((_ua == 0 || _ua == d) && (ub >= 0 && ub <= 1)) || ((_ub == 0 || _ub == d) && (ua >= 0 && ua <= 1)))
+		return false;
+
+	if ((ua > 0) && (ua < 1) && (ub > 0) && (ub < 1))
+		return true;
+
+	return false;
+}
+
+// One call to intersect(), with both segments copied out so every round reads the same memory
+struct query
+{
+	vertex p1, p2, q1, q2;
+};
+
+uint64_t time_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Add each edge of a polygon (and its holes) onto the list
+void add_edges (const polygon &poly, std::vector<vertex> &edges)
+{
+	for (int i = 0; i < poly.numVertices(); i++)
+	{
+		edges.push_back(poly.getVertex(i));
+		edges.push_back(poly.getVertex(i + 1));
+	}
+	for (int i = 0; i < poly.numHoles(); i++)
+		add_edges(poly.getHole(i), edges);
+}
+
+// Somewhere for the results to go before the clock stops, so the calls can't be moved past it
+volatile size_t sink;
+
+// Run every query through one version or the other, returning the fastest time and how many crossed
+template<bool old>
+uint64_t run (const std::vector<query> &queries, size_t &hits)
+{
+	uint64_t best = 0;
+	for (int r = 0; r < ROUNDS; r++)
+	{
+		size_t count = 0;
+		uint64_t start = time_ns();
+		for (size_t i = 0; i < queries.size(); i++)
+		{
+			const query &q = queries[i];
+			if (old ? intersect_old(q.p1, q.p2, q.q1, q.q2) : intersect(q.p1, q.p2, q.q1, q.q2))
+				count++;
+		}
+		sink = count;
+		uint64_t elapsed = time_ns() - start;
+		if (!r || (elapsed < best))
+			best = elapsed;
+		hits = count;
+	}
+	return best;
+}
+
+int main (int argc, char **argv)
+{
+	std::vector<node *> nodes;
+	std::vector<size_t> found;
+	std::vector<vertex> mine, theirs;
+	std::vector<query> pairs, rays;
+	size_t i, j, k, l;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <layer.dat> [queries]\n", argv[0]);
+		return 1;
+	}
+	size_t limit = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_QUERIES;
+
+	if (!readnodes<node>(argv[1], nodes, LAYER_METAL))
+		return 1;
+	if (!nodes.size())
+	{
+		fprintf(stderr, "No nodes found in %s!\n", argv[1]);
+		return 1;
+	}
+	printf("Read %i nodes\n", (int)nodes.size());
+
+	// Use the same segments collides() and isInside() would look at - edges of nodes whose
+	// bounding boxes touch, and rays from each of their vertices out past the other node
+	node_index index(nodes, 0, nodes.size());
+	for (i = 0; (i < nodes.size()) && ((pairs.size() < limit) || (rays.size() < limit)); i++)
+	{
+		mine.clear();
+		add_edges(nodes[i]->poly, mine);
+		index.find(nodes[i]->bbox, found);
+		for (j = 0; j < found.size(); j++)
+		{
+			theirs.clear();
+			add_edges(nodes[found[j]]->poly, theirs);
+			for (k = 0; k < mine.size(); k += 2)
+			{
+				for (l = 0; (l < theirs.size()) && (pairs.size() < limit); l += 2)
+				{
+					query q = { mine[k], mine[k + 1], theirs[l], theirs[l + 1] };
+					pairs.push_back(q);
+				}
+			}
+			for (l = 0; (l < theirs.size()) && (rays.size() < limit); l += 2)
+			{
+				// distant point at a slight angle, same as isInside()
+				const vertex &q1 = theirs[l];
+				const vertex q2(q1.x + 32768, q1.y + 128);
+				for (k = 0; (k < mine.size()) && (rays.size() < limit); k += 2)
+				{
+					query q = { mine[k], mine[k + 1], q1, q2 };
+					rays.push_back(q);
+				}
+			}
+		}
+	}
+
+	int mismatches = 0;
+	const std::vector<query> *sets[2] = { &pairs, &rays };
+	const char *names[2] = { "segment pairs", "isInside() rays" };
+	for (i = 0; i < 2; i++)
+	{
+		const std::vector<query> &queries = *sets[i];
+		if (!queries.size())
+			continue;
+		for (j = 0; j < queries.size(); j++)
+		{
+			const query &q = queries[j];
+			bool a = intersect_old(q.p1, q.p2, q.q1, q.q2);
+			bool b = intersect(q.p1, q.p2, q.q1, q.q2);
+			if (a == b)
+				continue;
+			if (mismatches++ < 10)
+				fprintf(stderr, "Mismatch: (%i,%i)-(%i,%i) vs (%i,%i)-(%i,%i) - old %i, new %i\n",
+					q.p1.x, q.p1.y, q.p2.x, q.p2.y, q.q1.x, q.q1.y, q.q2.x, q.q2.y, a, b);
+		}
+		size_t hits_old, hits_new;
+		uint64_t t_old = run<true>(queries, hits_old);
+		uint64_t t_new = run<false>(queries, hits_new);
+		printf("%i %s, %i crossing: long double %.2f ns, integer %.2f ns per call\n",
+			(int)queries.size(), names[i], (int)hits_new,
+			(double)t_old / queries.size(), (double)t_new / queries.size());
+	}
+	if (mismatches)
+	{
+		fprintf(stderr, "%i mismatches found!\n", mismatches);
+		return 1;
+	}
+	printf("No mismatches found\n");
+	return 0;
+}
@@ -31,28 +31,40 @@ using std::vector;
 bool find_hits (vector<node *> &nodes, vector<node *> &vias, int &nextNode, int pwr, int gnd, size_t outer_start, size_t outer_end, size_t inner_start, size_t inner_end, bool reversible = false)
 {
 	vector<node *> matched, unmatched;
+	vector<size_t> found;
 	node *via, *cur, *sub;
 
+	// each via is only matched once, after which it's deleted (and skipped from then on)
+	node_index via_index(vias, 0, vias.size());
+	vector<bool> used(vias.size(), false);
+	node_index inner_index(nodes, inner_start, inner_end);
+
 	for (size_t i = outer_start; i < outer_end; i++)
 	{
 		cur = nodes[i];
 		if (!cur->id)
 			cur->id = nextNode++;
-		for (size_t j = 0; j < vias.size(); j++)
+		via_index.find(cur->bbox, found);
+		for (size_t j = 0; j < found.size(); j++)
 		{
-			via = vias[j];
-			if (cur->collide(via) || (reversible && via->collide(cur)))
+			if (used[found[j]])
+				continue;
+			via = vias[found[j]];
+			if (reversible ? cur->collide(via) : cur->overlaps(via))
+			{
 				matched.push_back(via);
-			else	unmatched.push_back(via);
+				used[found[j]] = true;
+			}
 		}
 		while (!matched.empty())
 		{
 			via = matched.back();
 			matched.pop_back();
-			for (size_t j = inner_start; j < inner_end; j++)
+			inner_index.find(via->bbox, found);
+			for (size_t j = 0; j < found.size(); j++)
 			{
-				sub = nodes[j];
-				if (!sub->collide(via) && !(reversible && via->collide(sub)))
+				sub = nodes[found[j]];
+				if (!(reversible ? sub->collide(via) : sub->overlaps(via)))
 					continue;
 				if (sub->id == 0)
 					sub->id = cur->id;
@@ -74,9 +86,11 @@ bool find_hits (vector<node *> &nodes, vector<node *> &vias, int &nextNode, int
 			}
 			delete via;
 		}
-		vias = unmatched;
-		unmatched.clear();
 	}
+	for (size_t j = 0; j < vias.size(); j++)
+		if (!used[j])
+			unmatched.push_back(vias[j]);
+	vias = unmatched;
 
 	if (!vias.empty())
 	{
@@ -108,32 +122,44 @@ int main (int argc, char **argv)
 	size_t poly_start, poly_end;
 	size_t diff_start, diff_end;
 
+	// Start reading every layer file up front, all at once, so they're ready by the time they're needed
+	static const char *const layer_files[] = {
+		"metal2_pwr.dat", "metal2_gnd.dat", "metal2.dat",
+		"metal1_pwr.dat", "metal1_gnd.dat", "metal1.dat",
+		"metal_pwr.dat", "metal_gnd.dat", "metal.dat",
+		"poly_pwr.dat", "poly_gnd.dat", "poly.dat",
+		"diff_pwr.dat", "diff_gnd.dat", "diff.dat",
+		"vias2.dat", "vias1.dat", "vias.dat", "buried.dat",
+		"trans_n.dat", "trans.dat", "trans_p.dat"
+	};
+	layer_loader loader(layer_files, sizeof(layer_files) / sizeof(layer_files[0]));
+
 	metal2_start = nodes.size();
-	readnodes<node>("metal2_pwr.dat", nodes, LAYER_METAL, pwr);
-	readnodes<node>("metal2_gnd.dat", nodes, LAYER_METAL, gnd);
-	readnodes<node>("metal2.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal2_pwr.dat", nodes, LAYER_METAL, pwr);
+	loader.read<node>("metal2_gnd.dat", nodes, LAYER_METAL, gnd);
+	loader.read<node>("metal2.dat", nodes, LAYER_METAL);
 	metal2_end = nodes.size();
 
 	metal1_start = nodes.size();
-	readnodes<node>("metal1_pwr.dat", nodes, LAYER_METAL, pwr);
-	readnodes<node>("metal1_gnd.dat", nodes, LAYER_METAL, gnd);
-	readnodes<node>("metal1.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal1_pwr.dat", nodes, LAYER_METAL, pwr);
+	loader.read<node>("metal1_gnd.dat", nodes, LAYER_METAL, gnd);
+	loader.read<node>("metal1.dat", nodes, LAYER_METAL);
 	// Legacy support for NMOS chips
-	readnodes<node>("metal_pwr.dat", nodes, LAYER_METAL, pwr);
-	readnodes<node>("metal_gnd.dat", nodes, LAYER_METAL, gnd);
-	readnodes<node>("metal.dat", nodes, LAYER_METAL);
+	loader.read<node>("metal_pwr.dat", nodes, LAYER_METAL, pwr);
+	loader.read<node>("metal_gnd.dat", nodes, LAYER_METAL, gnd);
+	loader.read<node>("metal.dat", nodes, LAYER_METAL);
 	metal1_end = nodes.size();
 
 	poly_start = nodes.size();
-	readnodes<node>("poly_pwr.dat", nodes, LAYER_POLY, pwr);
-	readnodes<node>("poly_gnd.dat", nodes, LAYER_POLY, gnd);
-	readnodes<node>("poly.dat", nodes, LAYER_POLY);
+	loader.read<node>("poly_pwr.dat", nodes, LAYER_POLY, pwr);
+	loader.read<node>("poly_gnd.dat", nodes, LAYER_POLY, gnd);
+	loader.read<node>("poly.dat", nodes, LAYER_POLY);
 	poly_end = nodes.size();
 
 	diff_start = nodes.size();
-	readnodes<node>("diff_pwr.dat", nodes, LAYER_DIFF, pwr);
-	readnodes<node>("diff_gnd.dat", nodes, LAYER_DIFF, gnd);
-	readnodes<node>("diff.dat", nodes, LAYER_DIFF);
+	loader.read<node>("diff_pwr.dat", nodes, LAYER_DIFF, pwr);
+	loader.read<node>("diff_gnd.dat", nodes, LAYER_DIFF, gnd);
+	loader.read<node>("diff.dat", nodes, LAYER_DIFF);
 	diff_end = nodes.size();
 
 	// Sanity check: make sure we have at least one powered node
@@ -159,22 +185,22 @@ int main (int argc, char **argv)
 	}
 
 	// First, use 'vias2' to link 'metal2' to 'metal1'
-	readnodes<node>("vias2.dat", vias, LAYER_SPECIAL);
+	loader.read<node>("vias2.dat", vias, LAYER_SPECIAL);
 	printf("Parsing metal2 nodes %zi thru %zi with %zi vias\n", metal2_start, metal2_end - 1, vias.size());
 	if (!find_hits(nodes, vias, nextNode, pwr, gnd, metal2_start, metal2_end, metal1_start, metal1_end))
 		return 2;
 
 	// Next, use 'vias1' to link 'metal1' to poly/diff
-	readnodes<node>("vias1.dat", vias, LAYER_SPECIAL);
+	loader.read<node>("vias1.dat", vias, LAYER_SPECIAL);
 	// Legacy support for NMOS chips
-	readnodes<node>("vias.dat", vias, LAYER_SPECIAL);
+	loader.read<node>("vias.dat", vias, LAYER_SPECIAL);
 
 	printf("Parsing metal1 nodes %zi thru %zi with %zi vias\n", metal1_start, metal1_end - 1, vias.size());
 	if (!find_hits(nodes, vias, nextNode, pwr, gnd, metal1_start, metal1_end, poly_start, diff_end))
 		return 2;
 
 	// If we have any buried contacts, scan them
-	readnodes<node>("buried.dat", vias, LAYER_SPECIAL);
+	loader.read<node>("buried.dat", vias, LAYER_SPECIAL);
 
 	printf("Parsing polysilicon nodes %zi thru %zi with %zi buried contacts\n", poly_start, poly_end - 1, vias.size());
 	if (!find_hits(nodes, vias, nextNode, pwr, gnd, poly_start, poly_end, diff_start, diff_end, true))
@@ -203,15 +229,18 @@ int main (int argc, char **argv)
 	// TODO - add an option to go through all of the nodes and make the ID numbers consecutive
 
 	size_t trans_p_start;
-	readnodes<transistor>("trans_n.dat", transistors, LAYER_SPECIAL);
-	readnodes<transistor>("trans.dat", transistors, LAYER_SPECIAL);
+	loader.read<transistor>("trans_n.dat", transistors, LAYER_SPECIAL);
+	loader.read<transistor>("trans.dat", transistors, LAYER_SPECIAL);
 	trans_p_start = transistors.size();
-	readnodes<transistor>("trans_p.dat", transistors, LAYER_SPECIAL);
+	loader.read<transistor>("trans_p.dat", transistors, LAYER_SPECIAL);
 
 	transistor *cur_t;
 	nextNode = FIRST_TRANS_ID;
 
 	vector<node *> diffs;
+	vector<size_t> found;
+	node_index poly_index(nodes, poly_start, poly_end);
+	node_index diff_index(nodes, diff_start, diff_end);
 #ifdef NMOS
 	int pullups = 0;
 #endif
@@ -229,10 +258,11 @@ int main (int argc, char **argv)
 		cur_t->id = nextNode++;
 		cur_t->ptype = (i >= trans_p_start);
 
-		for (size_t j = poly_start; j < poly_end; j++)
+		poly_index.find(cur_t->bbox, found);
+		for (size_t j = 0; j < found.size(); j++)
 		{
-			sub = nodes[j];
-			if (sub->collide(cur_t))
+			sub = nodes[found[j]];
+			if (sub->overlaps(cur_t))
 			{
 				cur_t->gate = sub->id;
 				// Permanently disabled transistors (grounded N or powered P) get discarded at the end
@@ -261,10 +291,16 @@ int main (int argc, char **argv)
 
 		diffs.clear();
 		// Find all diff nodes which are touching the transistor
-		for (size_t j = diff_start; j < diff_end; j++)
+		rect near = cur_t->bbox;
+		near.xmin -= 2;
+		near.ymin -= 2;
+		near.xmax += 2;
+		near.ymax += 2;
+		diff_index.find(near, found);
+		for (size_t j = 0; j < found.size(); j++)
 		{
-			sub = nodes[j];
-			if (sub->collide(t1) || sub->collide(t2) || sub->collide(t3) || sub->collide(t4))
+			sub = nodes[found[j]];
+			if (sub->overlaps(t1) || sub->overlaps(t2) || sub->overlaps(t3) || sub->overlaps(t4))
 				diffs.push_back(sub);
 		}
 
@@ -8,14 +8,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <setjmp.h>
+#include <sys/stat.h>
 #include <png.h>
+#include "polydat.h"
 
 #ifdef WIN32
 #include <conio.h>
 #define getch _getch
 #else
 #include <termios.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
 char getch(void)
 {
 	char buf = 0;
@@ -34,8 +42,22 @@ char getch(void)
 #endif
 
 #include <vector>
-#include <map>
+#include <string>
 #include <set>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <climits>
+#include <chrono>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
 
 struct coord
 {
@@ -46,6 +68,10 @@ struct coord
 enum DIR { DIR_E, DIR_SE, DIR_S, DIR_SW, DIR_W, DIR_NW, DIR_N, DIR_NE, DIR_NONE };
 const char *dirs[9] = {"east", "southeast", "south", "southwest", "west", "northwest", "north", "northeast", "indeterminate"};
 const char dir_char[9] = {'6', '3', '2', '1', '4', '7', '8', '9', '?'};
+// coordinate adjustments for moving one step in each direction
+const int8_t dir_move[8][2] = {
+	{ 1, 0}, { 1, 1}, { 0, 1}, {-1, 1}, {-1, 0}, {-1,-1}, { 0,-1}, { 1,-1}
+};
 // coordinate adjustments for going around corners
 // 0 = upper-left
 // 1 = upper-right
@@ -64,72 +90,503 @@ const int8_t dir_delta[8][8] = {
 	{ 0, 1, 1, 4, 2, 2, 0, 4}  // from NE
 };
 
-std::map<int,DIR> rules;
+// Rules are stored as a dense table indexed by the 24-bit neighborhood mask,
+// packed 2 entries per byte - each entry holds the direction plus 1,
+// with 0 meaning that the mask has not been learned yet.
+// Version 2 files also hold every rotation of each learned mask.
+#define RULES_FILE	"pngtrace.rules"
+#define RULES_TEMP	"pngtrace.rules.tmp"
+#define RULES_LOCK	"pngtrace.rules.lock"
+#define RULES_SIZE	(1 << 23)
+const char rules_magic[8] = {'P', 'T', 'R', 'U', 'L', 'E', 'S', 2};
+
+uint8_t *rules = NULL;
 bool discard_rules = false;
+// Set when the user bails out of teaching a rule, so no other threads ask
+bool trace_aborted = false;
+// Held while learning new rules, so only one thread ever changes them at a time - lookups don't need it,
+// since each byte of the table is only ever read or replaced whole, with a single relaxed atomic access
+// (see rule_entry()), so a lookup sees either the old byte or the new one and at worst asks for the lock
+std::mutex rules_lock;
 
-void load_rules()
+// In automatic mode, unknown masks get a direction worked out from the mask itself instead of asking.
+// Those rules are only used for the current run - they get written out separately for review,
+// along with any masks which couldn't be worked out, rather than being saved with the learned rules.
+#define INFERRED_FILE	"pngtrace.inferred"
+bool auto_rules = false;
+std::map<int, DIR> inferred_rules;
+std::set<int> unresolved_rules;
+
+// Counters and timers for --stats, which can be updated from any thread - times are in nanoseconds
+struct trace_stats
 {
-	FILE *in = fopen("pngtrace.rules", "rb");
-	if (!in)
+	std::atomic<uint64_t> time_decode, time_classify, time_label, time_erase, time_trace, time_rules;
+	std::atomic<uint64_t> pixels, polygons, steps, lookups, learned;
+	// Largest polygon written, by vertex count
+	std::mutex lock;
+	size_t largest;
+	coord largest_at;
+} stats;
+
+uint64_t time_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Print the number of polygons traced so far, but not more than 10 times per second
+void show_progress(int total, bool force = false)
+{
+	static std::atomic<uint64_t> last(0);
+	uint64_t now = time_ns(), prev = last;
+	if (!force && now - prev < 100000000)
+		return;
+	if (!last.compare_exchange_strong(prev, now) && !force)
 		return;
-	rules.clear();
+	printf("%i...\r", total);
+	fflush(stdout);
+}
+
+// Each byte of the table holds the rules for two masks, so changing one means replacing the whole byte
+inline uint8_t rule_entry(int i)
+{
+#ifdef _MSC_VER
+	return *(volatile uint8_t *)&rules[i];
+#else
+	return __atomic_load_n(&rules[i], __ATOMIC_RELAXED);
+#endif
+}
+inline void set_rule_entry(int i, uint8_t entry)
+{
+#ifdef _MSC_VER
+	*(volatile uint8_t *)&rules[i] = entry;
+#else
+	__atomic_store_n(&rules[i], entry, __ATOMIC_RELAXED);
+#endif
+}
+
+DIR get_rule(int mask)
+{
+	uint8_t entry = (rule_entry(mask >> 1) >> ((mask & 1) << 2)) & 0xF;
+	if (!entry)
+		return DIR_NONE;
+	return (DIR)(entry - 1);
+}
+void set_rule(int mask, DIR dir)
+{
+	int shift = (mask & 1) << 2;
+	set_rule_entry(mask >> 1, (rule_entry(mask >> 1) & ~(0xF << shift)) | ((dir + 1) << shift));
+}
+void clear_rule(int mask)
+{
+	set_rule_entry(mask >> 1, rule_entry(mask >> 1) & ~(0xF << ((mask & 1) << 2)));
+}
+
+// Bit holding pixel N of the 5x5 neighborhood (numbered row by row from the top left) within a mask
+inline int mask_bit(int n)
+{
+	return (n < 12) ? (23 - n) : (24 - n);
+}
+
+// Turn a mask a quarter turn clockwise - the direction to go from there turns the same way,
+// since following the edge of a node doesn't care which way up the node is.
+// Mirror images don't work like that, since they'd go around the edge the other way.
+int rotate_mask(int mask)
+{
+	int result = 0;
+	for (int n = 0; n < 25; n++)
+	{
+		if (n == 12 || !((mask >> mask_bit(n)) & 1))
+			continue;
+		// x,y (relative to the center) moves to -y,x
+		int x = n % 5, y = n / 5;
+		result |= 1 << mask_bit(x * 5 + (4 - y));
+	}
+	return result;
+}
+
+// Learn a rule for all 4 rotations of a mask at once, leaving alone any of them which were already learned
+void set_rule_rotations(int mask, DIR dir)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		if (get_rule(mask) == DIR_NONE)
+			set_rule(mask, dir);
+		mask = rotate_mask(mask);
+		dir = (DIR)((dir + 2) & 7);
+	}
+}
+
+// Rules from older files only cover the masks which actually came up, so fill in their rotations
+void expand_rules()
+{
+	printf("Updating rules to cover every rotation...\n");
+	for (int mask = 0; mask < (1 << 24); mask++)
+	{
+		DIR dir = get_rule(mask);
+		if (dir != DIR_NONE)
+			set_rule_rotations(mask, dir);
+	}
+}
+
+// Work out which way to go for a mask by following the edge with the region on the right -
+// take the orthogonal neighbor just clockwise of an empty one (skipping over a filled diagonal),
+// but only if there's exactly one of them, since otherwise the edge passes through more than once
+DIR infer_rule(int mask)
+{
+	bool filled[8];
+	for (int d = 0; d < 8; d++)
+	{
+		int n = (dir_move[d][1] + 2) * 5 + (dir_move[d][0] + 2);
+		filled[d] = (mask >> mask_bit(n)) & 1;
+	}
+	DIR result = DIR_NONE;
+	for (int d = 0; d < 8; d += 2)
+	{
+		if (!filled[d] || (filled[(d + 7) & 7] && filled[(d + 6) & 7]))
+			continue;
+		if (result != DIR_NONE)
+			return DIR_NONE;
+		result = (DIR)d;
+	}
+	return result;
+}
+
+// Read the header of a rules file, returning its version (or 0 if it isn't in a format we can map)
+int rules_version(FILE *in)
+{
+	char magic[sizeof(rules_magic)];
+	if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, rules_magic, sizeof(magic) - 1))
+		return 0;
+	if (magic[7] != 1 && magic[7] != rules_magic[7])
+		return 0;
+	return magic[7];
+}
+
+// Map the rules file directly into memory, if it's already in the right format
+// (or the version before, which just needs expanding)
+// Returns 1 if it worked, 0 if the file isn't in either format, or -1 if it is but it's damaged or can't be read
+int map_rules(FILE *in, bool &expand)
+{
+	int version = rules_version(in);
+	if (!version)
+		return 0;
+	expand = (version == 1);
+#ifdef WIN32
+	fseek(in, 0, SEEK_END);
+	if (ftell(in) != sizeof(rules_magic) + RULES_SIZE)
+		return -1;
+	fseek(in, sizeof(rules_magic), SEEK_SET);
+	rules = (uint8_t *)malloc(RULES_SIZE);
+	if (fread(rules, RULES_SIZE, 1, in) != 1)
+	{
+		free(rules);
+		rules = NULL;
+		return -1;
+	}
+#else
+	struct stat st;
+	if (fstat(fileno(in), &st) || st.st_size != sizeof(rules_magic) + RULES_SIZE)
+		return -1;
+	// Private mapping, so newly learned rules don't get written back until we save them
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(in), 0);
+	if (map == MAP_FAILED)
+		return -1;
+	rules = (uint8_t *)map + sizeof(rules_magic);
+#endif
+	return 1;
+}
+
+// Returns false if the rules file couldn't be loaded, in which case 'rules' is left unset so it never gets saved over
+bool load_rules()
+{
+	FILE *in = fopen(RULES_FILE, "rb");
+	bool expand = false;
+	int mapped = in ? map_rules(in, expand) : 0;
+	if (mapped)
+	{
+		fclose(in);
+		if (mapped < 0)
+		{
+			// it's not in the old format either, so importing it that way would only make a mess of it
+			fprintf(stderr, "pngtrace: rules file '%s' is damaged or unreadable - fix or remove it first\n", RULES_FILE);
+			return false;
+		}
+		if (expand)
+			expand_rules();
+		return true;
+	}
+	rules = (uint8_t *)calloc(RULES_SIZE, 1);
+	if (!in)
+		return true;
+	// Import rules from the old format - a flat list of 32-bit entries
+	rewind(in);
 	while (true)
 	{
-		unsigned long entry;
+		uint32_t entry;
 		if (fread(&entry, 4, 1, in) == 0)
 			break;
 		int mask = (entry & 0xFFFFFF);
 		DIR dir = (DIR)((entry & 0xF000000) >> 24);
-		rules[mask] = dir;
+		if (dir < DIR_NONE)
+			set_rule(mask, dir);
 	}
 	fclose(in);
+	expand_rules();
+	return true;
+}
+
+// Pick up any rules which somebody else saved after ours were loaded, keeping ours wherever both have one
+void merge_rules()
+{
+	FILE *in = fopen(RULES_FILE, "rb");
+	if (!in)
+		return;
+	std::vector<uint8_t> theirs(RULES_SIZE);
+	bool ok = rules_version(in) && (fread(&theirs[0], RULES_SIZE, 1, in) == 1);
+	fclose(in);
+	if (!ok)
+		return;
+	for (int i = 0; i < RULES_SIZE; i++)
+	{
+		if (!theirs[i] || theirs[i] == rule_entry(i))
+			continue;
+		for (int half = 0; half < 2; half++)
+		{
+			int entry = (theirs[i] >> (half << 2)) & 0xF;
+			int mask = (i << 1) | half;
+			if (entry && get_rule(mask) == DIR_NONE)
+				set_rule_rotations(mask, (DIR)(entry - 1));
+		}
+	}
 }
+
 void save_rules()
 {
-	FILE *out = fopen("pngtrace.rules", "wb");
-	for (auto iter = rules.begin(); iter != rules.end(); iter++)
+	// Inferred rules are only written out for review, not saved along with the learned ones
+	for (auto iter = inferred_rules.begin(); iter != inferred_rules.end(); iter++)
+		clear_rule(iter->first);
+
+#ifndef WIN32
+	// Other copies of pngtrace might be saving their own rules at the same time,
+	// so merging theirs in and replacing the file has to happen while holding a lock
+	int lock = open(RULES_LOCK, O_RDWR | O_CREAT, 0666);
+	if (lock != -1 && flock(lock, LOCK_EX))
 	{
-		unsigned long entry = iter->first | ((int)iter->second << 24);
-		fwrite(&entry, 4, 1, out);
+		close(lock);
+		lock = -1;
 	}
-	fclose(out);
+#endif
+	merge_rules();
+
+	// Write to a temporary file and rename it over the old one,
+	// since the old one might still be mapped into memory
+	FILE *out = fopen(RULES_TEMP, "wb");
+	bool ok = (out != NULL);
+	if (!out)
+		fprintf(stderr, "pngtrace: could not create rules file '%s'\n", RULES_TEMP);
+	else
+	{
+		ok = (fwrite(rules_magic, sizeof(rules_magic), 1, out) == 1) && (fwrite(rules, RULES_SIZE, 1, out) == 1);
+		if (fclose(out) || !ok)
+		{
+			fprintf(stderr, "pngtrace: failed to write rules file '%s'\n", RULES_TEMP);
+			remove(RULES_TEMP);
+			ok = false;
+		}
+	}
+	if (ok)
+	{
+#ifdef WIN32
+		remove(RULES_FILE);
+#endif
+		if (rename(RULES_TEMP, RULES_FILE))
+			fprintf(stderr, "pngtrace: failed to replace rules file '%s'\n", RULES_FILE);
+	}
+#ifndef WIN32
+	if (lock != -1)
+		close(lock);
+#endif
+}
+
+// reverses the order of 5 bits
+const uint8_t rev5[32] = {
+	0x00, 0x10, 0x08, 0x18, 0x04, 0x14, 0x0C, 0x1C, 0x02, 0x12, 0x0A, 0x1A, 0x06, 0x16, 0x0E, 0x1E,
+	0x01, 0x11, 0x09, 0x19, 0x05, 0x15, 0x0D, 0x1D, 0x03, 0x13, 0x0B, 0x1B, 0x07, 0x17, 0x0F, 0x1F
+};
+
+// count trailing zeroes in a nonzero 64-bit word
+inline int ctz64 (uint64_t val)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward64(&idx, val);
+	return idx;
+#else
+	return __builtin_ctzll(val);
+#endif
+}
+
+// count set bits in a 64-bit word
+inline int popcount64 (uint64_t val)
+{
+#ifdef _MSC_VER
+	return (int)__popcnt64(val);
+#else
+	return __builtin_popcountll(val);
+#endif
 }
 
+// Pixels are stored row by row, 64 to a word, with the leftmost pixel in the lowest bit
 #define CHUNK_SIZE 256
+#define CHUNK_WORDS (CHUNK_SIZE / 64)
 struct img_chunk
 {
-	unsigned char pixels[CHUNK_SIZE][CHUNK_SIZE / 8];
+	uint64_t pixels[CHUNK_SIZE][CHUNK_WORDS];
+	// Number of set pixels, so empty chunks can be skipped entirely
+	int count;
+	void clear()
+	{
+		memset(pixels, 0, sizeof(pixels));
+		count = 0;
+	}
 	unsigned char get(int dx, int dy)
 	{
 		if (dx < 0 || dx >= CHUNK_SIZE || dy < 0 || dy >= CHUNK_SIZE)
 			return 0;
-		return (pixels[dx][dy / 8] >> (dy & 7)) & 1;
+		return (pixels[dy][dx / 64] >> (dx & 63)) & 1;
 	}
 	void set (int dx, int dy, bool val)
 	{
 		if (dx < 0 || dx >= CHUNK_SIZE || dy < 0 || dy >= CHUNK_SIZE)
 			return;
-		pixels[dx][dy / 8] &= ~(1 << (dy & 7));
-		if (val)
-			pixels[dx][dy / 8] |= 1 << (dy & 7);
+		if (get(dx, dy) == val)
+			return;
+		pixels[dy][dx / 64] ^= (uint64_t)1 << (dx & 63);
+		count += val ? 1 : -1;
 	}
 	void invert(int dx, int dy)
 	{
 		if (dx < 0 || dx >= CHUNK_SIZE || dy < 0 || dy >= CHUNK_SIZE)
 			return;
-		pixels[dx][dy / 8] ^= 1 << (dy & 7);
+		set(dx, dy, !get(dx, dy));
+	}
+};
+
+// Writes out traced polygons, either as text (one vertex per line, with -2,-2 before each hole and -1,-1 after each polygon)
+// or in the binary format from polydat.h, which has to be collected up and written out all at once
+struct poly_writer
+{
+	FILE *file;
+	bool binary;
+	std::vector<polydat_poly> polys;
+	std::vector<polydat_ring> rings;
+	std::vector<polydat_vertex> vertices;
+
+	poly_writer () : file(NULL), binary(false) { }
+
+	void write (const std::vector<coord> &poly)
+	{
+		if (poly.empty())
+			return;
+		stats.polygons++;
+		size_t count = poly.size() - std::count_if(poly.begin(), poly.end(), [](const coord &c) { return c.x == -2 && c.y == -2; });
+		{
+			std::lock_guard<std::mutex> lock(stats.lock);
+			if (count > stats.largest)
+			{
+				stats.largest = count;
+				stats.largest_at = poly[0];
+			}
+		}
+		if (!file)
+			return;
+		if (!binary)
+		{
+			for (size_t i = 0; i < poly.size(); i++)
+				fprintf(file, "%i,%i\n", poly[i].x, poly[i].y);
+			fprintf(file, "-1,-1\n");
+			return;
+		}
+
+		polydat_poly rec = { (uint32_t)rings.size(), 0, INT_MAX, INT_MAX, INT_MIN, INT_MIN, 0, 0 };
+		int64_t area = 0;
+		for (size_t i = 0; i <= poly.size(); i++)
+		{
+			if (i == poly.size() || (poly[i].x == -2 && poly[i].y == -2))
+			{
+				// finish off the current ring
+				polydat_ring &ring = rings.back();
+				int64_t a = 0;
+				for (uint32_t j = 0; j < ring.num_vertices; j++)
+				{
+					const polydat_vertex &v1 = vertices[ring.first_vertex + j];
+					const polydat_vertex &v2 = vertices[ring.first_vertex + (j + 1) % ring.num_vertices];
+					a += (int64_t)v1.x * v2.y - (int64_t)v2.x * v1.y;
+				}
+				a = ((a < 0) ? -a : a) / 2;
+				area += (rec.num_rings == 1) ? a : -a;
+				if (i == poly.size())
+					break;
+				continue;
+			}
+			if (i == 0 || (poly[i - 1].x == -2 && poly[i - 1].y == -2))
+			{
+				rings.push_back({ (uint32_t)vertices.size(), 0 });
+				rec.num_rings++;
+			}
+			vertices.push_back({ poly[i].x, poly[i].y });
+			rings.back().num_vertices++;
+			if (rec.num_rings == 1)
+			{
+				rec.xmin = std::min(rec.xmin, poly[i].x);
+				rec.ymin = std::min(rec.ymin, poly[i].y);
+				rec.xmax = std::max(rec.xmax, poly[i].x);
+				rec.ymax = std::max(rec.ymax, poly[i].y);
+			}
+		}
+		rec.area = (int32_t)area;
+		polys.push_back(rec);
+	}
+
+	// Write out everything collected for the binary format
+	bool finish ()
+	{
+		if (!file || !binary)
+			return true;
+		polydat_header hdr;
+		memcpy(hdr.magic, polydat_magic, sizeof(hdr.magic));
+		hdr.num_polys = polys.size();
+		hdr.num_rings = rings.size();
+		hdr.num_vertices = vertices.size();
+		hdr.reserved = 0;
+		bool ok = (fwrite(&hdr, sizeof(hdr), 1, file) == 1);
+		if (ok && polys.size())
+			ok = (fwrite(&polys[0], sizeof(polydat_poly), polys.size(), file) == polys.size());
+		if (ok && rings.size())
+			ok = (fwrite(&rings[0], sizeof(polydat_ring), rings.size(), file) == rings.size());
+		if (ok && vertices.size())
+			ok = (fwrite(&vertices[0], sizeof(polydat_vertex), vertices.size(), file) == vertices.size());
+		return ok;
 	}
 };
 
 struct img_data
 {
+	// One pointer per chunk, one column after another - chunks are only allocated once something gets written to them,
+	// and until then they all point to the same empty chunk
 	img_chunk **data;
 	int cw, ch, pw, ph;
+	// Set when the chunks live in a mapped cache file, rather than being allocated one at a time
+	void *mapping;
+	size_t mapping_size;
+	static img_chunk empty;
 
 	img_data()
 	{
 		data = NULL;
 		cw = ch = pw = ph = 0;
+		mapping = NULL;
+		mapping_size = 0;
 	}
 	~img_data()
 	{
@@ -140,402 +597,1825 @@ struct img_data
 		if (!data)
 			return;
 
-		int cx, cy;
-		for (cx = 0; cx < cw; cx++)
-			delete[] data[cx];
+		if (mapping)
+		{
+#ifndef WIN32
+			munmap(mapping, mapping_size);
+#endif
+			mapping = NULL;
+			mapping_size = 0;
+		}
+		else
+		{
+			for (int i = 0; i < cw * ch; i++)
+				if (data[i] != &empty)
+					delete data[i];
+		}
 
 		delete[] data;
 		data = NULL;
 		cw = ch = pw = ph = 0;
 	}
 
-	void alloc (int width, int height)
+	void set_size (int width, int height)
 	{
-		dealloc();
-
 		pw = width;
 		ph = height;
 		cw = (pw / CHUNK_SIZE) + 1;
 		ch = (ph / CHUNK_SIZE) + 1;
+	}
+
+	// Use chunks which have already been loaded into memory, stored one column after another
+	void attach (int width, int height, img_chunk *chunks, void *map, size_t map_size)
+	{
+		dealloc();
+		set_size(width, height);
+
+		data = new img_chunk *[cw * ch];
+		for (int i = 0; i < cw * ch; i++)
+			data[i] = chunks + i;
+		mapping = map;
+		mapping_size = map_size;
+	}
+
+	void alloc (int width, int height)
+	{
+		dealloc();
+		set_size(width, height);
 
-		int cx, cy, dx, dy;
+		data = new img_chunk *[cw * ch];
+		std::fill(data, data + cw * ch, &empty);
+	}
 
-		data = new img_chunk *[cw];
-		for (cx = 0; cx < cw; cx++)
+	img_chunk &chunk (int cx, int cy)
+	{
+		return *data[cx * ch + cy];
+	}
+	// Get a chunk to write into, allocating it if it's still empty
+	img_chunk &writable (int cx, int cy)
+	{
+		img_chunk *&ptr = data[cx * ch + cy];
+		if (ptr == &empty)
 		{
-			data[cx] = new img_chunk[ch];
-			for (cy = 0; cy < ch; cy++)
-			{
-				for (dx = 0; dx < CHUNK_SIZE; dx++)
-					for (dy = 0; dy < CHUNK_SIZE; dy++)
-						data[cx][cy].set(dx, dy, 0);
-			}
+			ptr = new img_chunk;
+			ptr->clear();
 		}
+		return *ptr;
 	}
+
 	void set (int x, int y, bool val)
 	{
 		if (x < 0 || x >= pw || y < 0 || y >= ph)
 			return;
-		data[x / CHUNK_SIZE][y / CHUNK_SIZE].set(x % CHUNK_SIZE, y % CHUNK_SIZE, val);
+		if (!val && !chunk(x / CHUNK_SIZE, y / CHUNK_SIZE).count)
+			return;
+		writable(x / CHUNK_SIZE, y / CHUNK_SIZE).set(x % CHUNK_SIZE, y % CHUNK_SIZE, val);
+	}
+	// Set 64 pixels at once, starting from a multiple of 64
+	void set_word (int x, int y, uint64_t bits)
+	{
+		if (x < 0 || x >= pw || y < 0 || y >= ph || !bits)
+			return;
+		img_chunk &dest = writable(x / CHUNK_SIZE, y / CHUNK_SIZE);
+		uint64_t &word = dest.pixels[y % CHUNK_SIZE][(x % CHUNK_SIZE) / 64];
+		dest.count += popcount64(bits & ~word);
+		word |= bits;
 	}
 	bool get (int x, int y)
 	{
 		if (x < 0 || x >= pw || y < 0 || y >= ph)
 			return 0;
-		return data[x / CHUNK_SIZE][y / CHUNK_SIZE].get(x % CHUNK_SIZE, y % CHUNK_SIZE);
+		return chunk(x / CHUNK_SIZE, y / CHUNK_SIZE).get(x % CHUNK_SIZE, y % CHUNK_SIZE);
 	}
 	void invert(int x, int y)
 	{
 		if (x < 0 || x >= pw || y < 0 || y >= ph)
 			return;
-		data[x / CHUNK_SIZE][y / CHUNK_SIZE].invert(x % CHUNK_SIZE, y % CHUNK_SIZE);
+		writable(x / CHUNK_SIZE, y / CHUNK_SIZE).invert(x % CHUNK_SIZE, y % CHUNK_SIZE);
 	}
 
-	void printmask (int cur_corner, DIR dir)
+	// Read 5 pixels going right from x,y, with the leftmost one in the highest bit
+	int get_row5 (int x, int y)
 	{
-		printf("0x%06X : %s\n", cur_corner, dirs[dir]);
-		for (int dy = 0; dy < 5; dy++)
+		int bits = 0;
+		if (x < 0 || x + 4 >= pw || y < 0 || y >= ph || (x % CHUNK_SIZE) > CHUNK_SIZE - 5)
 		{
-			for (int dx = 0; dx < 5; dx++)
-			{
-				if (dx == 2 && dy == 2)
-					printf("%c", dir_char[dir]);
-				else
-				{
-					printf("%c", (cur_corner & (1 << 23)) ? '*' : '.');
-					cur_corner <<= 1;
-				}
-			}
-			printf("\n");
+			for (int i = 0; i < 5; i++)
+				bits = (bits << 1) | get(x + i, y);
+			return bits;
+		}
+		const uint64_t *row = chunk(x / CHUNK_SIZE, y / CHUNK_SIZE).pixels[y % CHUNK_SIZE];
+		int dx = x % CHUNK_SIZE;
+		uint64_t word = row[dx / 64] >> (dx & 63);
+		// straddling two words
+		if ((dx & 63) > 59)
+			word |= row[dx / 64 + 1] << (64 - (dx & 63));
+		return rev5[word & 0x1F];
+	}
+	// Read 5 pixels going down from x,y, with the topmost one in the highest bit
+	int get_col5 (int x, int y)
+	{
+		int bits = 0;
+		if (x < 0 || x >= pw || y < 0 || y + 4 >= ph || (y % CHUNK_SIZE) > CHUNK_SIZE - 5)
+		{
+			for (int i = 0; i < 5; i++)
+				bits = (bits << 1) | get(x, y + i);
+			return bits;
 		}
+		img_chunk &src = chunk(x / CHUNK_SIZE, y / CHUNK_SIZE);
+		int dx = x % CHUNK_SIZE, dy = y % CHUNK_SIZE;
+		for (int i = 0; i < 5; i++)
+			bits = (bits << 1) | ((src.pixels[dy + i][dx / 64] >> (dx & 63)) & 1);
+		return bits;
 	}
 
-	bool is_corner(int x, int y, DIR &dir, int &cur_corner)
+	// Find the next set pixel in row y, starting from x
+	// Returns -1 if there aren't any more
+	int find_next (int x, int y)
 	{
-		cur_corner = 0;
-		for (int dy = 0; dy < 5; dy++)
+		if (x < 0 || y < 0 || y >= ph)
+			return -1;
+		int cy = y / CHUNK_SIZE, dy = y % CHUNK_SIZE;
+		while (x < pw)
 		{
-			for (int dx = 0; dx < 5; dx++)
+			img_chunk &src = chunk(x / CHUNK_SIZE, cy);
+			if (!src.count)
 			{
-				// Skip the center cell
-				if (dx == 2 && dy == 2)
-					continue;
-				cur_corner <<= 1;
-				if (get(x + dx - 2, y + dy - 2))
-					cur_corner |= 1;
+				x = (x / CHUNK_SIZE + 1) * CHUNK_SIZE;
+				continue;
 			}
+			int dx = x % CHUNK_SIZE;
+			uint64_t word = src.pixels[dy][dx / 64] >> (dx & 63);
+			if (word)
+				return x + ctz64(word);
+			x = (x | 63) + 1;
 		}
+		return -1;
+	}
 
-		if (rules.count(cur_corner))
+	// Find the next clear pixel in row y, starting from x
+	// Returns the image width if the rest of the row is set
+	int find_clear (int x, int y)
+	{
+		if (x < 0 || y < 0 || y >= ph)
+			return pw;
+		int cy = y / CHUNK_SIZE, dy = y % CHUNK_SIZE;
+		while (x < pw)
 		{
-			if (dir == rules.at(cur_corner))
-				return false;
-			dir = rules.at(cur_corner);
-			return true;
+			img_chunk &src = chunk(x / CHUNK_SIZE, cy);
+			if (!src.count)
+				return x;
+			int dx = x % CHUNK_SIZE;
+			uint64_t word = ~src.pixels[dy][dx / 64] >> (dx & 63);
+			if (word)
+				return std::min(x + ctz64(word), pw);
+			x = (x | 63) + 1;
 		}
+		return pw;
+	}
 
-		printf("Region at %i,%i unrecognized!\n", x, y);
-		printmask(cur_corner, dir);
-		printf("Specify target dir on numpad, 'q' to save+exit, 'x' to abort: ");
-		dir = DIR_NONE;
-		do
+	// Clear all pixels in row y from x0 up to (but not including) x1
+	void clear_span (int x0, int x1, int y)
+	{
+		x0 = std::max(x0, 0);
+		x1 = std::min(x1, pw);
+		if (y < 0 || y >= ph)
+			return;
+		int cy = y / CHUNK_SIZE, dy = y % CHUNK_SIZE;
+		while (x0 < x1)
 		{
-			char d = getch();
-			switch (d)
+			img_chunk &dest = chunk(x0 / CHUNK_SIZE, cy);
+			// Nothing to clear (and the shared empty chunk mustn't be touched)
+			if (!dest.count)
 			{
-			case '1': dir = DIR_SW;	break;
-			case '2': dir = DIR_S;	break;
-			case '3': dir = DIR_SE;	break;
-			case '4': dir = DIR_W;	break;
-			case '6': dir = DIR_E;	break;
-			case '7': dir = DIR_NW;	break;
-			case '8': dir = DIR_N;	break;
-			case '9': dir = DIR_NE;	break;
-			case 'x': case 'X':
-				discard_rules = true;
-			case 'q': case 'Q':
-				return false;
+				x0 = (x0 / CHUNK_SIZE + 1) * CHUNK_SIZE;
+				continue;
 			}
-		} while (dir == DIR_NONE);
-		printf("\n");
-
-		rules[cur_corner] = dir;
-		return true;
+			int dx = x0 % CHUNK_SIZE;
+			int bits = std::min(x1 - x0, 64 - (dx & 63));
+			uint64_t mask = ((bits == 64) ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1)) << (dx & 63);
+			dest.count -= popcount64(dest.pixels[dy][dx / 64] & mask);
+			dest.pixels[dy][dx / 64] &= ~mask;
+			x0 += bits;
+		}
 	}
 
-	bool find_corner (int &x, int &y, int &dx, int &dy, bool check_only = false)
+	void set_span (int x0, int x1, int y)
 	{
-		int ox = x, oy = y;
-		DIR dir = DIR_NONE;
-		int last;
-		if (!is_corner(x, y, dir, last))
-			return false;
-		if (check_only)
-			return true;
-		while (1)
+		x0 = std::max(x0, 0);
+		x1 = std::min(x1, pw);
+		if (y < 0 || y >= ph)
+			return;
+		int cy = y / CHUNK_SIZE, dy = y % CHUNK_SIZE;
+		while (x0 < x1)
 		{
-			switch (dir)
-			{
-			case DIR_E:	x++;		break;
-			case DIR_SE:	x++; 	y++;	break;
-			case DIR_S:		y++;	break;
-			case DIR_SW:	x--;	y++;	break;
-			case DIR_W:	x--;		break;
-			case DIR_NW:	x--;	y--;	break;
-			case DIR_N:		y--;	break;
-			case DIR_NE:	x++;	y--;	break;
-			}
-			if (!get(x, y))
-			{
-				printf("Somehow, this movement to %i,%i landed at an empty cell:\n", x, y);
-				printmask(last, dir);
-				return false;
-			}
-			DIR dir_prev = dir;
-			if (is_corner(x, y, dir, last))
-			{
-				int8_t delta = dir_delta[dir_prev][dir];
-				dx = (delta & 1) ? 1 : 0;
-				dy = (delta & 2) ? 1 : 0;
-				return true;
-			}
-			if (dir == DIR_NONE)
+			img_chunk &dest = writable(x0 / CHUNK_SIZE, cy);
+			int dx = x0 % CHUNK_SIZE;
+			int bits = std::min(x1 - x0, 64 - (dx & 63));
+			uint64_t mask = ((bits == 64) ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1)) << (dx & 63);
+			dest.count += popcount64(~dest.pixels[dy][dx / 64] & mask);
+			dest.pixels[dy][dx / 64] |= mask;
+			x0 += bits;
+		}
+	}
+
+	void doTrace(poly_writer &out, int threads = 1);
+	void doTraceParallel(poly_writer &out, int threads);
+	void doHollow();
+	void doInvert();
+};
+
+// Connected regions of set pixels, stored as horizontal runs
+struct img_run
+{
+	int x0, x1;	// x1 is exclusive
+	unsigned int label;
+};
+
+struct img_span
+{
+	int y, x0, x1;
+};
+
+img_chunk img_data::empty;
+
+struct img_labels
+{
+	// Runs in each row, from left to right
+	std::vector<std::vector<img_run>> rows;
+	// Top-left pixel of each region, in the order a raster scan would find them
+	std::vector<coord> seeds;
+	// Runs belonging to each region, with region N's runs starting at region_start[N]
+	std::vector<unsigned int> region_start;
+	std::vector<img_span> region_runs;
+
+	static unsigned int find_root (std::vector<unsigned int> &parent, unsigned int idx)
+	{
+		while (parent[idx] != idx)
+			idx = parent[idx] = parent[parent[idx]];
+		return idx;
+	}
+
+	void build (img_data &img)
+	{
+		std::vector<unsigned int> parent;
+		rows.assign(img.ph, std::vector<img_run>());
+		seeds.clear();
+		for (int y = 0; y < img.ph; y++)
+		{
+			std::vector<img_run> &row = rows[y];
+			for (int x = img.find_next(0, y); x != -1; x = img.find_next(x, y))
+			{
+				img_run run = {x, img.find_clear(x, y), (unsigned int)parent.size()};
+				parent.push_back(run.label);
+				row.push_back(run);
+				x = run.x1;
+			}
+			if (!y)
+				continue;
+			// Join up with any runs directly above
+			const std::vector<img_run> &prev = rows[y - 1];
+			for (size_t i = 0, j = 0; i < row.size() && j < prev.size(); )
+			{
+				if (row[i].x0 < prev[j].x1 && prev[j].x0 < row[i].x1)
+				{
+					unsigned int a = find_root(parent, row[i].label);
+					unsigned int b = find_root(parent, prev[j].label);
+					parent[std::max(a, b)] = std::min(a, b);
+				}
+				if (row[i].x1 < prev[j].x1)
+					i++;
+				else	j++;
+			}
+		}
+		// Number the regions in the order their first runs were found
+		std::vector<unsigned int> number(parent.size(), UINT_MAX);
+		for (int y = 0; y < img.ph; y++)
+		{
+			for (size_t i = 0; i < rows[y].size(); i++)
+			{
+				img_run &run = rows[y][i];
+				unsigned int root = find_root(parent, run.label);
+				if (number[root] == UINT_MAX)
+				{
+					number[root] = seeds.size();
+					seeds.push_back({run.x0, y});
+				}
+				run.label = number[root];
+			}
+		}
+		// Group the runs together by region
+		region_start.assign(seeds.size() + 1, 0);
+		for (int y = 0; y < img.ph; y++)
+			for (size_t i = 0; i < rows[y].size(); i++)
+				region_start[rows[y][i].label + 1]++;
+		for (size_t i = 0; i < seeds.size(); i++)
+			region_start[i + 1] += region_start[i];
+		std::vector<unsigned int> fill(region_start.begin(), region_start.end() - 1);
+		region_runs.resize(region_start.back());
+		for (int y = 0; y < img.ph; y++)
+		{
+			for (size_t i = 0; i < rows[y].size(); i++)
+			{
+				const img_run &run = rows[y][i];
+				region_runs[fill[run.label]++] = {y, run.x0, run.x1};
+			}
+		}
+	}
+
+	// Erase all of the pixels belonging to a particular region
+	void erase (img_data &img, unsigned int label) const
+	{
+		for (unsigned int i = region_start[label]; i < region_start[label + 1]; i++)
+			img.clear_span(region_runs[i].x0, region_runs[i].x1, region_runs[i].y);
+	}
+	// Check if a region touches the edge of the image
+	bool on_edge (const img_data &img, unsigned int label) const
+	{
+		for (unsigned int i = region_start[label]; i < region_start[label + 1]; i++)
+		{
+			const img_span &run = region_runs[i];
+			if (run.y == 0 || run.y == img.ph - 1 || run.x0 == 0 || run.x1 == img.pw)
+				return true;
+		}
+		return false;
+	}
+
+	// Read 5 pixels going right from x,y, only counting regions at or after min_label
+	int get_row5 (int x, int y, unsigned int min_label) const
+	{
+		if (y < 0 || y >= (int)rows.size())
+			return 0;
+		const std::vector<img_run> &row = rows[y];
+		// Find the first run which ends past x
+		auto iter = std::upper_bound(row.begin(), row.end(), x, [](int x, const img_run &run) { return x < run.x1; });
+		int bits = 0;
+		for (; iter != row.end() && iter->x0 < x + 5; iter++)
+		{
+			if (iter->label < min_label)
+				continue;
+			for (int i = std::max(iter->x0, x); i < std::min(iter->x1, x + 5); i++)
+				bits |= 0x10 >> (i - x);
+		}
+		return bits;
+	}
+	// Read 5 pixels going down from x,y, only counting regions at or after min_label
+	int get_col5 (int x, int y, unsigned int min_label) const
+	{
+		int bits = 0;
+		for (int i = 0; i < 5; i++)
+			bits = (bits << 1) | (get_row5(x, y + i, min_label) >> 4);
+		return bits;
+	}
+};
+
+// Walks around the edges of regions, one polygon at a time
+struct img_tracer
+{
+	img_data &img;
+	// If set, only regions at or after 'label' are visible,
+	// as if all of the earlier ones had already been erased
+	const img_labels *labels;
+	unsigned int label;
+	// Position of the bitmap within the full image, when tracing a piece cut out of it
+	int off_x, off_y;
+	// Counted locally, and only added onto the global stats once finished
+	uint64_t steps, lookups;
+
+	img_tracer (img_data &_img, const img_labels *_labels = NULL, unsigned int _label = 0) : img(_img), labels(_labels), label(_label), off_x(0), off_y(0), steps(0), lookups(0) { }
+	~img_tracer()
+	{
+		stats.steps += steps;
+		stats.lookups += lookups;
+	}
+
+	// Read pixels through the label filter, if there is one
+	int get_row5 (int x, int y)
+	{
+		int bits = img.get_row5(x, y);
+		if (bits && labels)
+			bits &= labels->get_row5(x, y, label);
+		return bits;
+	}
+	int get_col5 (int x, int y)
+	{
+		int bits = img.get_col5(x, y);
+		if (bits && labels)
+			bits &= labels->get_col5(x, y, label);
+		return bits;
+	}
+
+	// The 5x5 neighborhood around the current position is kept as a 25-bit window,
+	// one row of 5 bits at a time starting from the top, with the left pixel in the highest bit
+	int get_window (int x, int y)
+	{
+		int window = 0;
+		for (int dy = 0; dy < 5; dy++)
+			window = (window << 5) | get_row5(x - 2, y + dy - 2);
+		return window;
+	}
+	// Slide the window after moving one step in the specified direction to x,y,
+	// only reading the newly uncovered row and/or column
+	int shift_window (int window, int x, int y, DIR dir)
+	{
+		int mx = dir_move[dir][0], my = dir_move[dir][1];
+		if (mx > 0)
+			window = ((window << 1) & 0x1EF7BDE) | spread5(get_col5(x + 2, y - my - 2));
+		else if (mx < 0)
+			window = ((window >> 1) & 0x0F7BDEF) | (spread5(get_col5(x - 2, y - my - 2)) << 4);
+		if (my > 0)
+			window = ((window << 5) & 0x1FFFFFF) | get_row5(x - 2, y + 2);
+		else if (my < 0)
+			window = (window >> 5) | (get_row5(x - 2, y - 2) << 20);
+		return window;
+	}
+	// Strip the center pixel out of the window to get the mask used for rules
+	static int window_mask (int window)
+	{
+		return ((window >> 13) << 12) | (window & 0xFFF);
+	}
+	// Move a 5-bit column into the lowest bit of each row in the window
+	static int spread5 (int bits)
+	{
+		return (bits & 1) | ((bits & 2) << 4) | ((bits & 4) << 8) | ((bits & 8) << 12) | ((bits & 16) << 16);
+	}
+
+	static void printmask (int cur_corner, DIR dir, FILE *out = stdout)
+	{
+		fprintf(out, "0x%06X : %s\n", cur_corner, dirs[dir]);
+		for (int dy = 0; dy < 5; dy++)
+		{
+			for (int dx = 0; dx < 5; dx++)
+			{
+				if (dx == 2 && dy == 2)
+					fprintf(out, "%c", dir_char[dir]);
+				else
+				{
+					fprintf(out, "%c", (cur_corner & (1 << 23)) ? '*' : '.');
+					cur_corner <<= 1;
+				}
+			}
+			fprintf(out, "\n");
+		}
+	}
+
+	bool is_corner(int x, int y, DIR &dir, int cur_corner)
+	{
+		lookups++;
+		DIR rule = get_rule(cur_corner);
+		if (rule != DIR_NONE)
+		{
+			if (dir == rule)
+				return false;
+			dir = rule;
+			return true;
+		}
+
+		// Only one thread gets to ask at a time, and it might have been learned while we were waiting
+		std::lock_guard<std::mutex> lock(rules_lock);
+		if (trace_aborted)
+		{
+			dir = DIR_NONE;
+			return false;
+		}
+		rule = get_rule(cur_corner);
+		if (rule != DIR_NONE)
+		{
+			if (dir == rule)
+				return false;
+			dir = rule;
+			return true;
+		}
+
+		if (auto_rules)
+		{
+			rule = infer_rule(cur_corner);
+			if (rule == DIR_NONE)
+			{
+				if (unresolved_rules.insert(cur_corner).second)
+				{
+					printf("Region at %i,%i unrecognized, and no direction could be inferred!\n", x + off_x, y + off_y);
+					printmask(cur_corner, dir);
+				}
+				dir = DIR_NONE;
+				return false;
+			}
+			inferred_rules[cur_corner] = rule;
+			set_rule(cur_corner, rule);
+			if (dir == rule)
+				return false;
+			dir = rule;
+			return true;
+		}
+
+		printf("Region at %i,%i unrecognized!\n", x + off_x, y + off_y);
+		printmask(cur_corner, dir);
+		printf("Specify target dir on numpad, 'q' to save+exit, 'x' to abort: ");
+		dir = DIR_NONE;
+		do
+		{
+			char d = getch();
+			switch (d)
+			{
+			case '1': dir = DIR_SW;	break;
+			case '2': dir = DIR_S;	break;
+			case '3': dir = DIR_SE;	break;
+			case '4': dir = DIR_W;	break;
+			case '6': dir = DIR_E;	break;
+			case '7': dir = DIR_NW;	break;
+			case '8': dir = DIR_N;	break;
+			case '9': dir = DIR_NE;	break;
+			case 'x': case 'X':
+				discard_rules = true;
+			case 'q': case 'Q':
+				trace_aborted = true;
+				return false;
+			}
+		} while (dir == DIR_NONE);
+		printf("\n");
+
+		set_rule_rotations(cur_corner, dir);
+		stats.learned++;
+		return true;
+	}
+
+	bool find_corner (int &x, int &y, int &dx, int &dy, int &window, bool check_only = false)
+	{
+		int ox = x, oy = y;
+		DIR dir = DIR_NONE;
+		int last = window_mask(window);
+		if (!is_corner(x, y, dir, last))
+			return false;
+		if (check_only)
+			return true;
+		while (1)
+		{
+			x += dir_move[dir][0];
+			y += dir_move[dir][1];
+			window = shift_window(window, x, y, dir);
+			steps++;
+			// Center pixel
+			if (!(window & (1 << 12)))
+			{
+				printf("Somehow, this movement to %i,%i landed at an empty cell:\n", x + off_x, y + off_y);
+				printmask(last, dir);
+				return false;
+			}
+			DIR dir_prev = dir;
+			last = window_mask(window);
+			if (is_corner(x, y, dir, last))
+			{
+				int8_t delta = dir_delta[dir_prev][dir];
+				dx = (delta & 1) ? 1 : 0;
+				dy = (delta & 2) ? 1 : 0;
+				return true;
+			}
+			if (dir == DIR_NONE)
 			{
-				printf("Aborted.\n");
+				if (!auto_rules || trace_aborted)
+					printf("Aborted.\n");
 				return false;
 			}
-			if (x < 0 || x >= pw || y < 0 || y >= ph)
+			if (x < 0 || x >= img.pw || y < 0 || y >= img.ph)
 			{
-				printf("Walked off edge! (going %s from %i,%i)\n", dirs[dir], ox, oy);
+				printf("Walked off edge! (going %s from %i,%i)\n", dirs[dir], ox + off_x, oy + off_y);
 				return false;
 			}
 		}
 	}
 
-	bool trace(FILE *out, int x, int y)
+	bool trace(std::vector<coord> &poly, int x, int y)
 	{
 		int ox, oy;
 		int dx, dy;
-		if (!find_corner(x, y, dx, dy, true))
+		int window = get_window(x, y);
+		poly.clear();
+		if (!find_corner(x, y, dx, dy, window, true))
 		{
-			printf("Node at %i,%i did not start at recognized corner!\n", x, y);
+			printf("Node at %i,%i did not start at recognized corner!\n", x + off_x, y + off_y);
 			return false;
 		}
 		ox = x;
 		oy = y;
 		do
 		{
-			if (!find_corner(x, y, dx, dy))
+			if (!find_corner(x, y, dx, dy, window))
 				return false;
-			if (out)
-				fprintf(out, "%i,%i\n", x + dx, y + dy);
+			poly.push_back({x + dx + off_x, y + dy + off_y});
 		} while (x != ox || y != oy);
-		if (out)
-			fprintf(out, "-1,-1\n");
 		return true;
 	}
+};
+
+// Trace every hole inside a region, appending each one to the polygon after a -2,-2 marker.
+// A hole is any 4-connected area which the region completely surrounds, so everything in the
+// region's bounding box (plus a 1-pixel border) except the region itself gets cut out into its own bitmap,
+// anything reaching the border is thrown away, and whatever is left gets traced just like a region.
+// If the labels came from a piece cut out of the full image, off_x/off_y give the position of that piece.
+bool trace_holes (const img_labels &labels, unsigned int label, std::vector<coord> &poly, int off_x = 0, int off_y = 0)
+{
+	unsigned int first = labels.region_start[label], last = labels.region_start[label + 1];
+	// Nothing can be surrounded unless some row has a gap between two of the region's runs
+	bool gaps = false;
+	int x0 = INT_MAX, x1 = INT_MIN;
+	for (unsigned int i = first; i < last; i++)
+	{
+		const img_span &run = labels.region_runs[i];
+		if (i > first && labels.region_runs[i - 1].y == run.y)
+			gaps = true;
+		x0 = std::min(x0, run.x0);
+		x1 = std::max(x1, run.x1);
+	}
+	if (!gaps)
+		return true;
+	int y0 = labels.region_runs[first].y, y1 = labels.region_runs[last - 1].y + 1;
+
+	img_data holes;
+	holes.alloc(x1 - x0 + 2, y1 - y0 + 2);
+	for (int y = 0; y < holes.ph; y++)
+		holes.set_span(0, holes.pw, y);
+	for (unsigned int i = first; i < last; i++)
+	{
+		const img_span &run = labels.region_runs[i];
+		holes.clear_span(run.x0 - x0 + 1, run.x1 - x0 + 1, run.y - y0 + 1);
+	}
+	img_labels found;
+	found.build(holes);
+	for (unsigned int i = 0; i < found.seeds.size(); i++)
+		if (found.on_edge(holes, i))
+			found.erase(holes, i);
+
+	img_tracer tracer(holes);
+	tracer.off_x = off_x + x0 - 1;
+	tracer.off_y = off_y + y0 - 1;
+	std::vector<coord> hole;
+	for (unsigned int i = 0; i < found.seeds.size(); i++)
+	{
+		if (found.on_edge(holes, i))
+			continue;
+		if (!tracer.trace(hole, found.seeds[i].x, found.seeds[i].y))
+			return false;
+		poly.push_back({-2, -2});
+		poly.insert(poly.end(), hole.begin(), hole.end());
+		found.erase(holes, i);
+	}
+	return true;
+}
+
+// Write out the rules inferred in automatic mode (and the masks which couldn't be) so they can be reviewed
+void save_inferred()
+{
+	if (inferred_rules.empty() && unresolved_rules.empty())
+		return;
+	printf("Inferred %i new rules, %i masks could not be resolved - see '%s'\n", (int)inferred_rules.size(), (int)unresolved_rules.size(), INFERRED_FILE);
+	FILE *out = fopen(INFERRED_FILE, "wt");
+	if (!out)
+	{
+		fprintf(stderr, "pngtrace: could not create inferred rules file '%s'\n", INFERRED_FILE);
+		return;
+	}
+	for (auto iter = inferred_rules.begin(); iter != inferred_rules.end(); iter++)
+		img_tracer::printmask(iter->first, iter->second, out);
+	for (auto iter = unresolved_rules.begin(); iter != unresolved_rules.end(); iter++)
+		img_tracer::printmask(*iter, DIR_NONE, out);
+	fclose(out);
+}
+
+// In automatic mode, nodes which can't be traced get left out, rather than stopping everything
+bool skip_failed()
+{
+	return auto_rules && !trace_aborted;
+}
+
+void img_data::doTrace(poly_writer &out, int threads)
+{
+	int total = 0;
+	if (!data)
+		return;
+	if (threads > 1)
+	{
+		doTraceParallel(out, threads);
+		return;
+	}
+	// Label every region up front, then trace them in order, erasing each one afterwards
+	uint64_t start = time_ns();
+	img_labels labels;
+	labels.build(*this);
+	uint64_t label_end = time_ns(), erase_time = 0;
+	stats.time_label += label_end - start;
+	img_tracer tracer(*this);
+	std::vector<coord> poly;
+	for (unsigned int i = 0; i < labels.seeds.size(); i++)
+	{
+		total++;
+		if (!tracer.trace(poly, labels.seeds[i].x, labels.seeds[i].y) || !trace_holes(labels, i, poly))
+		{
+			if (!skip_failed())
+				break;
+			printf("Skipping node at %i,%i\n", labels.seeds[i].x, labels.seeds[i].y);
+			poly.clear();
+		}
+		out.write(poly);
+		show_progress(total);
+		uint64_t erase_start = time_ns();
+		labels.erase(*this, i);
+		erase_time += time_ns() - erase_start;
+	}
+	show_progress(total, true);
+	stats.time_erase += erase_time;
+	stats.time_trace += time_ns() - label_end - erase_time;
+}
+
+void img_data::doHollow()
+{
+	doInvert();
+	printf("Searching for holes...\n");
+	img_labels labels;
+	labels.build(*this);
+	for (unsigned int i = 0; i < labels.seeds.size(); i++)
+		printf("Hole found at %i,%i\n", labels.seeds[i].x, labels.seeds[i].y);
+}
+
+void img_data::doInvert()
+{
+	printf("Inverting image...\n");
+	for (int cx = 0; cx < cw; cx++)
+	{
+		// Only flip the pixels which are actually inside the image
+		int width = std::min(pw - cx * CHUNK_SIZE, CHUNK_SIZE);
+		uint64_t mask[CHUNK_WORDS];
+		for (int i = 0; i < CHUNK_WORDS; i++)
+		{
+			int bits = std::min(std::max(width - i * 64, 0), 64);
+			mask[i] = (bits == 64) ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1);
+		}
+		for (int cy = 0; cy < ch; cy++)
+		{
+			img_chunk &dest = writable(cx, cy);
+			int height = std::min(ph - cy * CHUNK_SIZE, CHUNK_SIZE);
+			for (int dy = 0; dy < height; dy++)
+				for (int i = 0; i < CHUNK_WORDS; i++)
+					dest.pixels[dy][i] ^= mask[i];
+			dest.count = width * height - dest.count;
+		}
+	}
+	// Anything connected to the edge of the image is background, rather than a hole
+	printf("Clearing background...\n");
+	img_labels labels;
+	labels.build(*this);
+	for (unsigned int i = 0; i < labels.seeds.size(); i++)
+		if (labels.on_edge(*this, i))
+			labels.erase(*this, i);
+}
+
+// Size of the tiles handed out to each worker thread
+#define TILE_SIZE 512
+
+// Label every region up front, then trace them on multiple threads, with each thread
+// taking all of the regions whose top-left pixels fall within a particular tile.
+// Nothing gets erased - each region is traced as if every region before it were already gone,
+// so the results are identical to a serial run, and they get written out in the same order.
+void img_data::doTraceParallel(poly_writer &out, int threads)
+{
+	uint64_t start = time_ns();
+	img_labels labels;
+	labels.build(*this);
+	uint64_t label_end = time_ns();
+	stats.time_label += label_end - start;
+	unsigned int regions = labels.seeds.size();
+
+	int tw = (pw / TILE_SIZE) + 1;
+	int th = (ph / TILE_SIZE) + 1;
+	std::vector<std::vector<unsigned int>> tiles(tw * th);
+	for (unsigned int i = 0; i < regions; i++)
+	{
+		const coord &seed = labels.seeds[i];
+		tiles[(seed.y / TILE_SIZE) * tw + (seed.x / TILE_SIZE)].push_back(i);
+	}
+
+	std::vector<std::vector<coord>> polys(regions);
+	std::atomic<unsigned int> next_tile(0), total(0);
+	// Lowest region which failed to trace - everything after it gets discarded
+	std::atomic<unsigned int> failed(regions);
+	auto worker = [&]()
+	{
+		while (true)
+		{
+			unsigned int tile = next_tile++;
+			if (tile >= tiles.size())
+				break;
+			for (size_t j = 0; j < tiles[tile].size(); j++)
+			{
+				unsigned int i = tiles[tile][j];
+				if (i > failed)
+					break;
+				img_tracer tracer(*this, &labels, i);
+				if (!tracer.trace(polys[i], labels.seeds[i].x, labels.seeds[i].y) || !trace_holes(labels, i, polys[i]))
+				{
+					if (skip_failed())
+					{
+						printf("Skipping node at %i,%i\n", labels.seeds[i].x, labels.seeds[i].y);
+						polys[i].clear();
+						continue;
+					}
+					unsigned int cur = failed;
+					while (i < cur && !failed.compare_exchange_weak(cur, i))
+						;
+					break;
+				}
+				show_progress(++total);
+			}
+		}
+	};
+	std::vector<std::thread> pool;
+	for (int i = 0; i < threads; i++)
+		pool.push_back(std::thread(worker));
+	for (int i = 0; i < threads; i++)
+		pool[i].join();
+
+	for (unsigned int i = 0; i < failed; i++)
+		out.write(polys[i]);
+	show_progress(total, true);
+	stats.time_trace += time_ns() - label_end;
+}
+
+// How far decoding is allowed to get ahead of tracing in pipelined mode, in rows
+#define PIPELINE_ROWS 1024
+
+// In band mode, only the rows which are still needed are kept in memory, stored as runs rather than as a bitmap.
+// Rows get labelled as they arrive, and each region is traced once it has finished and everything near it
+// which comes after it has finished too (since merging with something else could still move one of those ahead of it).
+// Each region gets traced from a piece cut out around it, holding just what a serial run would still see at that point,
+// and the polygons are written out in the same order as a serial run, so the output is identical.
+struct img_stream
+{
+	struct region
+	{
+		unsigned int parent;
+		coord seed;
+		int x0, x1;	// x1 is exclusive
+		int y1;		// last row with any runs in it
+	};
+	// Position of a region's top-left pixel, ordered the way a raster scan would find them
+	typedef std::pair<int, int> key;
+
+	int cur;	// last row added
+	int base;	// first row still being held
+	std::deque<std::vector<img_run>> rows;
+	std::vector<region> regions;
+	// Every region which hasn't been traced yet, and the finished ones among them
+	std::map<key, unsigned int> untraced, waiting;
+	// Polygons waiting for everything before them to be written out
+	std::map<key, std::vector<coord>> traced;
+	// Bitmap each region gets cut out into for tracing
+	img_data piece;
+	// Lowest region which failed to trace - everything after it gets discarded
+	bool failed;
+	key failed_at;
+	int total;
+
+	// When decoding runs on a separate thread, rows get handed over through here
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<std::vector<img_run>> incoming;
+	bool closed, discard;
+
+	img_stream () : cur(-1), base(0), failed(false), total(0), closed(false), discard(false) { }
+
+	static key seed_key (const region &r)
+	{
+		return key(r.seed.y, r.seed.x);
+	}
+	unsigned int find_root (unsigned int idx)
+	{
+		while (regions[idx].parent != idx)
+			idx = regions[idx].parent = regions[regions[idx].parent].parent;
+		return idx;
+	}
+	// Join two regions together, keeping whichever one was found first
+	void merge (unsigned int a, unsigned int b)
+	{
+		a = find_root(a);
+		b = find_root(b);
+		if (a == b)
+			return;
+		if (seed_key(regions[b]) < seed_key(regions[a]))
+			std::swap(a, b);
+		region &keep = regions[a], &gone = regions[b];
+		gone.parent = a;
+		keep.x0 = std::min(keep.x0, gone.x0);
+		keep.x1 = std::max(keep.x1, gone.x1);
+		keep.y1 = std::max(keep.y1, gone.y1);
+		untraced.erase(seed_key(gone));
+	}
+
+	// Take the next row out of a one-row bitmap, clearing it for the row after
+	static void take_row (img_data &img, std::vector<img_run> &row)
+	{
+		row.clear();
+		for (int x = img.find_next(0, 0); x != -1; x = img.find_next(x, 0))
+		{
+			row.push_back({x, img.find_clear(x, 0), UINT_MAX});
+			x = row.back().x1;
+			img.clear_span(row.back().x0, x, 0);
+		}
+	}
+	void add_row (img_data &img)
+	{
+		std::vector<img_run> row;
+		take_row(img, row);
+		add_runs(row);
+	}
+	void add_runs (std::vector<img_run> &row)
+	{
+		int y = ++cur;
+		// Join up with any runs directly above
+		const std::vector<img_run> *prev = rows.empty() ? NULL : &rows.back();
+		for (size_t i = 0, j = 0; prev && i < row.size() && j < prev->size(); )
+		{
+			const img_run &above = (*prev)[j];
+			if (row[i].x0 < above.x1 && above.x0 < row[i].x1)
+			{
+				if (row[i].label == UINT_MAX)
+					row[i].label = above.label;
+				else	merge(row[i].label, above.label);
+			}
+			if (row[i].x1 < above.x1)
+				i++;
+			else	j++;
+		}
+		for (size_t i = 0; i < row.size(); i++)
+		{
+			img_run &run = row[i];
+			if (run.label == UINT_MAX)
+			{
+				run.label = regions.size();
+				regions.push_back({run.label, {run.x0, y}, run.x0, run.x1, y});
+				untraced[key(y, run.x0)] = run.label;
+				continue;
+			}
+			region &r = regions[find_root(run.label)];
+			r.x0 = std::min(r.x0, run.x0);
+			r.x1 = std::max(r.x1, run.x1);
+			r.y1 = y;
+		}
+		// Anything in the row above which didn't carry on into this one is finished
+		for (size_t j = 0; prev && j < prev->size(); j++)
+		{
+			unsigned int root = find_root((*prev)[j].label);
+			if (regions[root].y1 < y)
+				waiting[seed_key(regions[root])] = root;
+		}
+		rows.push_back(row);
+	}
+
+	// Runs in row y which might overlap anything from x0 up to (but not including) x1
+	std::vector<img_run>::const_iterator find_runs (int y, int x0) const
+	{
+		const std::vector<img_run> &row = rows[y - base];
+		return std::upper_bound(row.begin(), row.end(), x0, [](int x, const img_run &run) { return x < run.x1; });
+	}
+
+	// A finished region can be traced once the rows just below it have arrived,
+	// as long as nothing close enough to be seen while tracing it, and coming after it, is still growing
+	bool ready (unsigned int id)
+	{
+		const region &r = regions[id];
+		if (cur < r.y1 + 2)
+			return false;
+		key k = seed_key(r);
+		for (int y = std::max(r.seed.y - 2, base); y <= r.y1 + 2; y++)
+		{
+			const std::vector<img_run> &row = rows[y - base];
+			for (auto iter = find_runs(y, r.x0 - 2); iter != row.end() && iter->x0 < r.x1 + 2; iter++)
+			{
+				const region &other = regions[find_root(iter->label)];
+				if (other.y1 >= cur && seed_key(other) > k)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	// Cut out the region (plus a 2-pixel border) along with everything after it, then trace it
+	bool trace (unsigned int id, std::vector<coord> &poly)
+	{
+		const region &r = regions[id];
+		key k = seed_key(r);
+		int x0 = r.x0 - 2, y0 = r.seed.y - 2;
+		int w = r.x1 - r.x0 + 4, h = r.y1 - r.seed.y + 5;
+		// The same bitmap gets reused for every region, and only grows when one doesn't fit
+		if (w > piece.pw || h > piece.ph)
+			piece.alloc(std::max(w, piece.pw), std::max(h, piece.ph));
+		// Only the region itself needs labelling, for finding its holes
+		img_labels labels;
+		labels.seeds.push_back({r.seed.x - x0, r.seed.y - y0});
+		for (int y = std::max(y0, base); y < y0 + h; y++)
+		{
+			const std::vector<img_run> &row = rows[y - base];
+			for (auto iter = find_runs(y, x0); iter != row.end() && iter->x0 < x0 + w; iter++)
+			{
+				unsigned int root = find_root(iter->label);
+				if (root == id)
+					labels.region_runs.push_back({y - y0, iter->x0 - x0, iter->x1 - x0});
+				if (root == id || seed_key(regions[root]) > k)
+					piece.set_span(iter->x0 - x0, std::min(iter->x1 - x0, w), y - y0);
+			}
+		}
+		labels.region_start.push_back(0);
+		labels.region_start.push_back(labels.region_runs.size());
+		bool ok;
+		{
+			img_tracer tracer(piece);
+			tracer.off_x = x0;
+			tracer.off_y = y0;
+			ok = tracer.trace(poly, labels.seeds[0].x, labels.seeds[0].y) && trace_holes(labels, 0, poly, x0, y0);
+		}
+		for (int y = 0; y < h; y++)
+			piece.clear_span(0, w, y);
+		return ok;
+	}
+
+	// Trace whichever regions are ready, write out anything which can be, and drop the rows nothing needs any more
+	void process (poly_writer &out)
+	{
+		for (auto iter = waiting.begin(); iter != waiting.end(); )
+		{
+			if (failed && iter->first > failed_at)
+				break;
+			unsigned int id = iter->second;
+			if (!ready(id))
+			{
+				iter++;
+				continue;
+			}
+			total++;
+			std::vector<coord> &poly = traced[iter->first];
+			if (!trace(id, poly))
+			{
+				const coord &seed = regions[id].seed;
+				if (!skip_failed())
+				{
+					// Left as untraced, so nothing after it gets written out
+					traced.erase(iter->first);
+					if (!failed || iter->first < failed_at)
+						failed_at = iter->first;
+					failed = true;
+					iter = waiting.erase(iter);
+					continue;
+				}
+				printf("Skipping node at %i,%i\n", seed.x, seed.y);
+				poly.clear();
+			}
+			untraced.erase(iter->first);
+			iter = waiting.erase(iter);
+			show_progress(total);
+		}
+
+		while (!traced.empty() && (untraced.empty() || traced.begin()->first < untraced.begin()->first))
+		{
+			out.write(traced.begin()->second);
+			traced.erase(traced.begin());
+		}
+
+		int keep = untraced.empty() ? cur : std::min(cur, untraced.begin()->first.first - 2);
+		while (base < keep)
+		{
+			rows.pop_front();
+			base++;
+		}
+	}
+
+	// Once a region fails, there's no point going any further than the regions before it
+	bool done () const
+	{
+		return failed && untraced.begin()->first >= failed_at;
+	}
+
+	// Add a couple of empty rows past the bottom of the image, so everything left can finish
+	void finish (poly_writer &out)
+	{
+		std::vector<img_run> empty;
+		add_runs(empty);
+		add_runs(empty);
+		process(out);
+		show_progress(total, true);
+	}
 
-	void floodErase(int x, int y)
+	// Hand over the next row to the tracing thread, waiting if it's fallen too far behind
+	void push (std::vector<img_run> &row, size_t limit)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [&]() { return incoming.size() < limit; });
+		incoming.push_back(std::vector<img_run>());
+		incoming.back().swap(row);
+		changed.notify_all();
+	}
+	// No more rows are coming - if they're being discarded, don't bother tracing what's left
+	void close (bool _discard)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
+		discard = _discard;
+		changed.notify_all();
+	}
+	// Follow along behind the decoding thread, tracing whatever's ready every 'band' rows
+	void run (poly_writer &out, int band)
 	{
-		std::vector<coord> flood;
-		flood.push_back({x, y});
-		while (!flood.empty())
+		std::vector<img_run> row;
+		for (int count = 1; ; count++)
 		{
-			coord cur = flood.back();
-			flood.pop_back();
-			if (!get(cur.x, cur.y))
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				changed.wait(guard, [&]() { return !incoming.empty() || closed; });
+				if (incoming.empty() || discard)
+					break;
+				row.swap(incoming.front());
+				incoming.pop_front();
+				changed.notify_all();
+			}
+			if (done())
 				continue;
-			set(cur.x, cur.y, 0);
-			flood.push_back({cur.x - 1, cur.y});
-			flood.push_back({cur.x + 1, cur.y});
-			flood.push_back({cur.x, cur.y - 1});
-			flood.push_back({cur.x, cur.y + 1});
+			uint64_t label_start = time_ns();
+			add_runs(row);
+			uint64_t trace_start = time_ns();
+			stats.time_label += trace_start - label_start;
+			if (count % band == 0)
+				process(out);
+			stats.time_trace += time_ns() - trace_start;
+		}
+		if (discard)
+			return;
+		uint64_t trace_start = time_ns();
+		finish(out);
+		stats.time_trace += time_ns() - trace_start;
+	}
+};
+
+unsigned int get_rgb(int channels, png_const_bytep row, png_uint_32 x)
+{
+	unsigned char alpha = 0xFF;
+	// If we have 4 channels, there's an Alpha channel
+	if (channels == 4)
+		alpha = row[x * channels + 3];
+	// If it's fully transparent, just return black
+	if (alpha == 0)
+		return 0;
+
+	// Read colors
+	unsigned int rgb = (row[x * channels + 0] << 16) | (row[x * channels + 1] << 8) | (row[x * channels + 2] << 0);
+	// If it's not fully opaque, add an error marker
+	if (alpha != 0xFF)
+		rgb |= 0xF0000000;
+	return rgb;
+}
+
+// libpng helper functions
+#define LIBPNG_SETJMP(ret) if (setjmp(png_jmpbuf(png_ptr))) return ret;
+
+bool readpng_init (FILE *infile, png_structp &png_ptr, png_infop &info_ptr, png_uint_32 &width, png_uint_32 &height, int &channels, png_bytep &row, unsigned int *palette)
+{
+	// Make sure this is actually a PNG file
+	unsigned char header[8];
+	if (fread(header, 1, 8, infile) != 8)
+		return false;
+	if (!png_check_sig(header, 8))
+		return false;
+
+	// Create PNG reader
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr)
+		return false;
+
+	// Create PNG info
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr)
+		return false;
+
+	// Setup error handler, in case anything below fails
+	LIBPNG_SETJMP(false)
+
+	// Open the file
+	png_init_io(png_ptr, infile);
+	// Skip the header, since we already read that above
+	png_set_sig_bytes(png_ptr, 8);
+	// Read file info
+	png_read_info(png_ptr, info_ptr);
+
+	// Read the image data header to get general characteristics
+	int bit_depth, color_type, interlace;
+	png_uint_32 ihdr = png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace, NULL, NULL);
+	if (!ihdr)
+	{
+		fprintf(stderr, "pngtrace: failed to read image header\n");
+		return false;
+	}
+	// Don't mess with interlaced images, not worth the trouble
+	if (interlace != PNG_INTERLACE_NONE)
+	{
+		fprintf(stderr, "pngtrace: interlaced images are not supported\n");
+		return false;
+	}
+
+	// Request some transformations to make things easier for us
+	if (color_type == PNG_COLOR_TYPE_PALETTE)
+	{
+		// Leave paletted images as indices, one byte per pixel, and classify them using the palette
+		if (bit_depth < 8)
+			png_set_packing(png_ptr);
+
+		png_colorp plte = NULL;
+		int num_plte = 0;
+		png_get_PLTE(png_ptr, info_ptr, &plte, &num_plte);
+		png_bytep trans = NULL;
+		int num_trans = 0;
+		if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+			png_get_tRNS(png_ptr, info_ptr, &trans, &num_trans, NULL);
+		// Out-of-range indices come out as black, same as when expanding them to RGB
+		for (int i = 0; i < 256; i++)
+		{
+			png_byte px[4] = { 0, 0, 0, 0xFF };
+			if (i < num_plte)
+			{
+				px[0] = plte[i].red;
+				px[1] = plte[i].green;
+				px[2] = plte[i].blue;
+				if (i < num_trans)
+					px[3] = trans[i];
+			}
+			palette[i] = get_rgb(4, px, 0);
+		}
+	}
+	else
+	{
+		// Expand grayscale to 8-bit
+		if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+			png_set_expand_gray_1_2_4_to_8(png_ptr);
+		// Convert color key transparency to alpha channel
+		if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+			png_set_tRNS_to_alpha(png_ptr);
+		// Otherwise, add an opaque alpha channel so every pixel is 4 bytes
+		else if (!(color_type & PNG_COLOR_MASK_ALPHA))
+			png_set_filler(png_ptr, 0xFF, PNG_FILLER_AFTER);
+		// Promote grayscale to RGB
+		if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+			png_set_gray_to_rgb(png_ptr);
+		// Reduce RGB-48 down to RGB-24
+		if (bit_depth == 16)
+			png_set_strip_16(png_ptr);
+	}
+
+	// Apply the above transformations
+	png_read_update_info(png_ptr, info_ptr);
+
+	// Make sure we have a proper channel count - either 1 (palette index) or 4 (RGBA)
+	channels = png_get_channels(png_ptr, info_ptr);
+	if (channels != ((color_type == PNG_COLOR_TYPE_PALETTE) ? 1 : 4) || png_get_bit_depth(png_ptr, info_ptr) != 8)
+	{
+		fprintf(stderr, "pngtrace: image transform failed, got unexpected channel count %i\n", channels);
+		return false;
+	}
+
+	// Allocate the row buffer
+	row = (png_bytep)png_malloc(png_ptr, png_get_rowbytes(png_ptr, info_ptr));
+	return true;
+}
+
+bool readpng_read_row(png_structp &png_ptr, png_infop &info_ptr, png_bytep row)
+{
+	LIBPNG_SETJMP(false)
+
+	png_read_row(png_ptr, row, NULL);
+	return true;
+}
+
+bool readpng_finish(png_structp &png_ptr, png_infop &info_ptr)
+{
+	LIBPNG_SETJMP(false)
+
+	png_read_end(png_ptr, NULL);
+	return true;
+}
+
+void readpng_cleanup(png_structp &png_ptr, png_infop &info_ptr, png_bytep &row)
+{
+	if (row)
+	{
+		png_free(png_ptr, row);
+		row = NULL;
+	}
+	if (png_ptr)
+	{
+		if (info_ptr)
+			png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		else	png_destroy_read_struct(&png_ptr, NULL, NULL);
+		png_ptr = NULL;
+		info_ptr = NULL;
+	}
+}
+
+// A single color to extract from the image, along with where to write its polygons
+struct trace_job
+{
+	unsigned int color;
+	std::string filename;
+	poly_writer out;
+	img_data pixels;
+	// Only used in band mode, where 'pixels' just holds the row being decoded
+	img_stream stream;
+	trace_job (unsigned int _color, const std::string &_filename) : color(_color), filename(_filename) { }
+};
+
+// Parse a list of colors and output files, in the form "RRGGBB=file.dat,RRGGBB=file.dat,..."
+bool parse_jobs (const char *arg, std::vector<trace_job *> &jobs)
+{
+	std::string list(arg);
+	size_t pos = 0;
+	while (pos <= list.size())
+	{
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos)
+			end = list.size();
+		std::string item = list.substr(pos, end - pos);
+		size_t eq = item.find('=');
+		if (eq == std::string::npos || eq == 0 || eq == item.size() - 1)
+		{
+			fprintf(stderr, "pngtrace: invalid color mapping '%s'\n", item.c_str());
+			return false;
+		}
+		jobs.push_back(new trace_job(std::strtoul(item.substr(0, eq).c_str(), nullptr, 16), item.substr(eq + 1)));
+		pos = end + 1;
+	}
+	return true;
+}
+
+// Build a pixel value as it appears in memory in a decoded RGBA row
+inline uint32_t raw_rgba (png_byte r, png_byte g, png_byte b, png_byte a)
+{
+	png_byte px[4] = { r, g, b, a };
+	uint32_t raw;
+	memcpy(&raw, px, 4);
+	return raw;
+}
+
+// Sorts decoded rows into each job's bitmap, 64 pixels at a time, and keeps track of which colors are present
+struct row_classifier
+{
+	std::vector<trace_job *> &jobs;
+	int width;
+	// Paletted images are decoded as one index per pixel, and each job gets a table of which indices it wants
+	bool paletted;
+	unsigned int palette[256];
+	bool used[256];
+	std::vector<uint8_t> index_match;
+	// Otherwise, each job gets its color as a raw RGBA pixel, or 0 to match all non-black pixels
+	std::vector<uint32_t> targets;
+	// Small open-addressed hash set of colors seen in RGBA images, with 0 marking empty slots
+	std::vector<unsigned int> census;
+	size_t census_used;
+
+	row_classifier (std::vector<trace_job *> &_jobs) : jobs(_jobs), width(0), paletted(false), census(1024, 0), census_used(0)
+	{
+		memset(palette, 0, sizeof(palette));
+		memset(used, 0, sizeof(used));
+	}
+
+	void init (int _width, int channels)
+	{
+		width = _width;
+		paletted = (channels == 1);
+		index_match.assign(jobs.size() * 256, 0);
+		targets.assign(jobs.size(), 0);
+		for (size_t j = 0; j < jobs.size(); j++)
+		{
+			unsigned int c = jobs[j]->color;
+			if (c)
+				targets[j] = raw_rgba((c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF, 0xFF);
+			for (int i = 0; i < 256; i++)
+				index_match[j * 256 + i] = palette[i] && (!c || palette[i] == c);
+		}
+	}
+
+	void add_color (unsigned int c)
+	{
+		if (census_used * 2 >= census.size())
+		{
+			std::vector<unsigned int> old;
+			old.swap(census);
+			census.assign(old.size() * 2, 0);
+			census_used = 0;
+			for (size_t i = 0; i < old.size(); i++)
+				if (old[i])
+					add_color(old[i]);
+		}
+		size_t mask = census.size() - 1;
+		for (size_t h = (c * 0x9E3779B1u) & mask; ; h = (h + 1) & mask)
+		{
+			if (census[h] == c)
+				return;
+			if (!census[h])
+			{
+				census[h] = c;
+				census_used++;
+				return;
+			}
+		}
+	}
+
+	// Compare up to 64 RGBA pixels against a target, returning one bit per match
+	static uint64_t match_rgba (png_const_bytep pixels, int count, uint32_t target)
+	{
+		const uint32_t amask = raw_rgba(0, 0, 0, 0xFF), cmask = raw_rgba(0xFF, 0xFF, 0xFF, 0);
+		uint64_t bits = 0;
+		int i = 0;
+#ifdef USE_SSE2
+		const __m128i vt = _mm_set1_epi32(target), va = _mm_set1_epi32(amask), vc = _mm_set1_epi32(cmask), zero = _mm_setzero_si128();
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(pixels + i * 4));
+			__m128i m;
+			if (target)
+				m = _mm_cmpeq_epi32(v, vt);
+			else
+			{
+				// skip anything transparent, or opaque black
+				__m128i a = _mm_and_si128(v, va);
+				__m128i skip = _mm_or_si128(_mm_cmpeq_epi32(a, zero), _mm_and_si128(_mm_cmpeq_epi32(a, va), _mm_cmpeq_epi32(_mm_and_si128(v, vc), zero)));
+				m = _mm_andnot_si128(skip, _mm_cmpeq_epi32(v, v));
+			}
+			bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(m)) << i;
+		}
+#endif
+		for (; i < count; i++)
+		{
+			uint32_t v;
+			memcpy(&v, pixels + i * 4, 4);
+			bool match;
+			if (target)
+				match = (v == target);
+			else	match = (v & amask) && (((v & amask) != amask) || (v & cmask));
+			if (match)
+				bits |= (uint64_t)1 << i;
+		}
+		return bits;
+	}
+
+	// Check whether any RGBA pixel in a row is neither fully opaque nor fully transparent
+	static bool any_partial (png_const_bytep pixels, int count)
+	{
+		const uint32_t amask = raw_rgba(0, 0, 0, 0xFF);
+		int i = 0;
+#ifdef USE_SSE2
+		const __m128i va = _mm_set1_epi32(amask), zero = _mm_setzero_si128();
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(pixels + i * 4)), va);
+			if (_mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(a, zero), _mm_cmpeq_epi32(a, va)))) != 0xF)
+				return true;
+		}
+#endif
+		for (; i < count; i++)
+		{
+			png_byte alpha = pixels[i * 4 + 3];
+			if (alpha != 0 && alpha != 0xFF)
+				return true;
 		}
+		return false;
 	}
 
-	void doTrace(FILE *out)
+	// Classify one decoded row into row 'into' of each bitmap, returning true if any partially transparent pixels were found
+	bool classify (png_const_bytep row, int y, int into)
 	{
-		int total = 0;
-		if (!data)
-			return;
-		for (int py = 0; py < ph; py++)
+		bool partial = false;
+		if (paletted)
 		{
-			for (int px = 0; px < pw; px++)
+			for (size_t j = 0; j < jobs.size(); j++)
 			{
-				if (!get(px, py))
-					continue;
-				total++;
-				if (!trace(out, px, py))
-					return;
-				printf("%i...\r", total);
-				floodErase(px, py);
+				const uint8_t *match = &index_match[j * 256];
+				for (int x = 0; x < width; x += 64)
+				{
+					int count = std::min(64, width - x);
+					uint64_t bits = 0;
+					for (int i = 0; i < count; i++)
+						bits |= (uint64_t)match[row[x + i]] << i;
+					if (bits)
+						jobs[j]->pixels.set_word(x, into, bits);
+				}
+			}
+			for (int x = 0; x < width; x++)
+			{
+				used[row[x]] = true;
+				if (palette[row[x]] & 0xF0000000)
+				{
+					printf("Partially transparent pixel %06X detected at %i,%i\n", palette[row[x]] & 0xFFFFFF, x, y);
+					partial = true;
+				}
 			}
+			return partial;
 		}
-	}
 
-	void doHollow()
-	{
-		doInvert();
-		printf("Searching for holes...\n");
-		for (int py = 0; py < ph; py++)
+		for (size_t j = 0; j < jobs.size(); j++)
 		{
-			for (int px = 0; px < pw; px++)
+			for (int x = 0; x < width; x += 64)
 			{
-				if (!get(px, py))
-					continue;
-				printf("Hole found at %i,%i\n", px, py);
-				floodErase(px, py);
+				uint64_t bits = match_rgba(row + x * 4, std::min(64, width - x), targets[j]);
+				if (bits)
+					jobs[j]->pixels.set_word(x, into, bits);
+			}
+		}
+		if (any_partial(row, width))
+		{
+			for (int x = 0; x < width; x++)
+			{
+				unsigned int c = get_rgb(4, row, x);
+				if (c & 0xF0000000)
+				{
+					printf("Partially transparent pixel %06X detected at %i,%i\n", c & 0xFFFFFF, x, y);
+					partial = true;
+				}
 			}
 		}
+		// Only look up a pixel's color when it differs from the one before it
+		uint32_t last = 0;
+		for (int x = 0; x < width; x++)
+		{
+			uint32_t v;
+			memcpy(&v, row + x * 4, 4);
+			if (x && v == last)
+				continue;
+			last = v;
+			unsigned int c = get_rgb(4, row, x);
+			if (c)
+				add_color(c);
+		}
+		return partial;
 	}
 
-	void doInvert()
+	// Collect the final list of (non-black) colors found in the image
+	void get_colors (std::set<unsigned int> &colors)
 	{
-		printf("Inverting image...\n");
-		for (int px = 0; px < pw; px++)
-			for (int py = 0; py < ph; py++)
-				invert(px, py);
-		printf("Clearing background...\n");
-		floodErase(0, 0);
+		if (paletted)
+		{
+			for (int i = 0; i < 256; i++)
+				if (used[i] && palette[i])
+					colors.insert(palette[i]);
+			return;
+		}
+		for (size_t i = 0; i < census.size(); i++)
+			if (census[i])
+				colors.insert(census[i]);
 	}
-} pixels;
+};
 
-unsigned int get_rgb(int channels, png_const_bytep row, png_uint_32 x)
+// Decoded bitmaps are cached next to the PNG file, one file per color, so repeat runs can skip decoding.
+// Each one holds a header identifying the PNG it came from, the list of colors found in the image,
+// and then every chunk of the bitmap, one column after another, exactly as img_data stores them.
+const char cache_magic[8] = {'P', 'T', 'C', 'A', 'C', 'H', 'E', 1};
+
+struct cache_header
 {
-	unsigned char alpha = 0xFF;
-	// If we have 4 channels, there's an Alpha channel
-	if (channels == 4)
-		alpha = row[x * channels + 3];
-	// If it's fully transparent, just return black
-	if (alpha == 0)
-		return 0;
+	char magic[8];
+	// Identifies the source image
+	uint64_t file_size;
+	int64_t file_mtime;
+	uint64_t file_hash;
+	// Describes the bitmap
+	uint32_t color;
+	uint32_t width, height;
+	uint32_t chunk_size;
+	uint32_t num_colors;
+	uint32_t reserved;
+};
 
-	// Read colors
-	unsigned int rgb = (row[x * channels + 0] << 16) | (row[x * channels + 1] << 8) | (row[x * channels + 2] << 0);
-	// If it's not fully opaque, add an error marker
-	if (alpha != 0xFF)
-		rgb |= 0xF0000000;
-	return rgb;
+// Offset of the bitmap within a cache file, after the header and color list
+size_t cache_data_offset (const cache_header &hdr)
+{
+	return (sizeof(cache_header) + hdr.num_colors * sizeof(uint32_t) + 7) & ~(size_t)7;
 }
 
-// libpng helper functions
-#define LIBPNG_SETJMP(ret) if (setjmp(png_jmpbuf(png_ptr))) return ret;
+std::string cache_filename (const char *filename, unsigned int color)
+{
+	char suffix[16];
+	sprintf(suffix, ".%06X.cache", color);
+	return std::string(filename) + suffix;
+}
 
-bool readpng_init (FILE *infile, png_structp &png_ptr, png_infop &info_ptr, png_uint_32 &width, png_uint_32 &height, int &channels, png_bytep &row)
+// Identify a PNG file by its size, modification time, and a hash of its contents
+bool cache_key (const char *filename, cache_header &key)
 {
-	// Make sure this is actually a PNG file
-	unsigned char header[8];
-	if (fread(header, 1, 8, infile) != 8)
-		return false;
-	if (!png_check_sig(header, 8))
-		return false;
+	memset(&key, 0, sizeof(key));
+	memcpy(key.magic, cache_magic, sizeof(cache_magic));
+	key.chunk_size = sizeof(img_chunk);
 
-	// Create PNG reader
-	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_ptr)
+	struct stat st;
+	if (stat(filename, &st))
 		return false;
-
-	// Create PNG info
-	info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr)
+	FILE *in = fopen(filename, "rb");
+	if (!in)
 		return false;
+	key.file_size = st.st_size;
+	key.file_mtime = st.st_mtime;
 
-	// Setup error handler, in case anything below fails
-	LIBPNG_SETJMP(false)
+	// FNV-1a, 8 bytes at a time
+	std::vector<uint64_t> buf(1 << 14);
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	while (true)
+	{
+		size_t len = fread(&buf[0], 1, buf.size() * sizeof(uint64_t), in);
+		if (!len)
+			break;
+		// zero-pad the last partial word
+		memset((uint8_t *)&buf[0] + len, 0, (8 - (len & 7)) & 7);
+		for (size_t i = 0; i < (len + 7) / 8; i++)
+			hash = (hash ^ buf[i]) * 0x100000001B3ULL;
+	}
+	fclose(in);
+	key.file_hash = hash;
+	return true;
+}
 
-	// Open the file
-	png_init_io(png_ptr, infile);
-	// Skip the header, since we already read that above
-	png_set_sig_bytes(png_ptr, 8);
-	// Read file info
-	png_read_info(png_ptr, info_ptr);
+// Load a cached bitmap, if there is one and it matches the current image
+bool load_cache (const char *filename, const cache_header &key, trace_job &job, std::set<unsigned int> &colors)
+{
+	std::string name = cache_filename(filename, job.color);
+	FILE *in = fopen(name.c_str(), "rb");
+	if (!in)
+		return false;
 
-	// Read the image data header to get general characteristics
-	int bit_depth, color_type, interlace;
-	png_uint_32 ihdr = png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace, NULL, NULL);
-	if (!ihdr)
+	cache_header hdr;
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, key.magic, sizeof(hdr.magic)) ||
+		hdr.file_size != key.file_size || hdr.file_mtime != key.file_mtime || hdr.file_hash != key.file_hash ||
+		hdr.color != job.color || hdr.chunk_size != key.chunk_size)
 	{
-		fprintf(stderr, "pngtrace: failed to read image header\n");
+		fclose(in);
 		return false;
 	}
-	// Don't mess with interlaced images, not worth the trouble
-	if (interlace != PNG_INTERLACE_NONE)
+	std::vector<uint32_t> found(hdr.num_colors);
+	if (hdr.num_colors && fread(&found[0], sizeof(uint32_t), hdr.num_colors, in) != hdr.num_colors)
 	{
-		fprintf(stderr, "pngtrace: interlaced images are not supported\n");
+		fclose(in);
 		return false;
 	}
 
-	// Request some transformations to make things easier for us
-	// Expand paletted images to RGB
-	if (color_type == PNG_COLOR_TYPE_PALETTE)
-		png_set_palette_to_rgb(png_ptr);
-	// Expand grayscale to 8-bit
-	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-		png_set_expand_gray_1_2_4_to_8(png_ptr);
-	// Convert palette transparency to alpha channel
-	if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
-		png_set_tRNS_to_alpha(png_ptr);
-	// Promote grayscale to RGB
-	if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-		png_set_gray_to_rgb(png_ptr);
-	// Reduce RGB-48 down to RGB-24
-	if (bit_depth == 16)
-		png_set_strip_16(png_ptr);
-
-	// Apply the above transformations
-	png_read_update_info(png_ptr, info_ptr);
-
-	// Make sure we have a proper channel count - either 3 (RGB) or 4 (RGBA)
-	channels = png_get_channels(png_ptr, info_ptr);
-	if (channels < 2 || channels > 4)
+	size_t offset = cache_data_offset(hdr);
+#ifdef WIN32
+	job.pixels.alloc(hdr.width, hdr.height);
+	bool ok = !fseek(in, offset, SEEK_SET);
+	img_chunk *chunk = new img_chunk;
+	for (int i = 0; ok && i < job.pixels.cw * job.pixels.ch; i++)
 	{
-		fprintf(stderr, "pngtrace: image transform failed, got unexpected channel count %i\n", channels);
+		ok = (fread(chunk, sizeof(img_chunk), 1, in) == 1);
+		if (ok && chunk->count)
+		{
+			job.pixels.data[i] = chunk;
+			chunk = new img_chunk;
+		}
+	}
+	delete chunk;
+	fclose(in);
+	if (!ok)
+	{
+		job.pixels.dealloc();
 		return false;
 	}
-
-	// Allocate the row buffer
-	row = (png_bytep)png_malloc(png_ptr, png_get_rowbytes(png_ptr, info_ptr));
+#else
+	size_t chunks = (size_t)(hdr.width / CHUNK_SIZE + 1) * (hdr.height / CHUNK_SIZE + 1);
+	struct stat st;
+	if (fstat(fileno(in), &st) || st.st_size != offset + chunks * sizeof(img_chunk))
+	{
+		fclose(in);
+		return false;
+	}
+	// Private mapping, since tracing erases pixels as it goes
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(in), 0);
+	fclose(in);
+	if (map == MAP_FAILED)
+		return false;
+	job.pixels.attach(hdr.width, hdr.height, (img_chunk *)((uint8_t *)map + offset), map, st.st_size);
+#endif
+	colors.insert(found.begin(), found.end());
 	return true;
 }
 
-bool readpng_read_row(png_structp &png_ptr, png_infop &info_ptr, png_bytep row)
+// Write out a freshly decoded bitmap, before tracing starts erasing it
+void save_cache (const char *filename, const cache_header &key, trace_job &job, const std::set<unsigned int> &colors)
 {
-	LIBPNG_SETJMP(false)
+	std::string name = cache_filename(filename, job.color);
+	std::string temp = name + ".tmp";
+	FILE *out = fopen(temp.c_str(), "wb");
+	if (!out)
+	{
+		fprintf(stderr, "pngtrace: could not create cache file '%s'\n", temp.c_str());
+		return;
+	}
 
-	png_read_row(png_ptr, row, NULL);
-	return true;
+	cache_header hdr = key;
+	hdr.color = job.color;
+	hdr.width = job.pixels.pw;
+	hdr.height = job.pixels.ph;
+	hdr.num_colors = colors.size();
+	std::vector<uint32_t> found(colors.begin(), colors.end());
+	found.resize(cache_data_offset(hdr) / sizeof(uint32_t) - sizeof(hdr) / sizeof(uint32_t), 0);
+
+	bool ok = (fwrite(&hdr, sizeof(hdr), 1, out) == 1);
+	if (ok && found.size())
+		ok = (fwrite(&found[0], sizeof(uint32_t), found.size(), out) == found.size());
+	for (int i = 0; ok && i < job.pixels.cw * job.pixels.ch; i++)
+		ok = (fwrite(job.pixels.data[i], sizeof(img_chunk), 1, out) == 1);
+	if (fclose(out) || !ok)
+	{
+		fprintf(stderr, "pngtrace: failed to write cache file '%s'\n", temp.c_str());
+		remove(temp.c_str());
+		return;
+	}
+#ifdef WIN32
+	remove(name.c_str());
+#endif
+	if (rename(temp.c_str(), name.c_str()))
+		fprintf(stderr, "pngtrace: failed to replace cache file '%s'\n", name.c_str());
 }
 
-bool readpng_finish(png_structp &png_ptr, png_infop &info_ptr)
+bool open_outputs (std::vector<trace_job *> &jobs, bool binary)
 {
-	LIBPNG_SETJMP(false)
-
-	png_read_end(png_ptr, NULL);
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (jobs[i]->filename.empty())
+			continue;
+		jobs[i]->out.binary = binary;
+		jobs[i]->out.file = fopen(jobs[i]->filename.c_str(), binary ? "wb" : "wt");
+		if (!jobs[i]->out.file)
+		{
+			fprintf(stderr, "pngtrace: could not create output file '%s'\n", jobs[i]->filename.c_str());
+			return false;
+		}
+	}
 	return true;
 }
 
-void readpng_cleanup(png_structp &png_ptr, png_infop &info_ptr, png_bytep &row)
+void print_stats(bool several)
 {
-	if (row)
+	printf("Statistics:\n");
+	printf("  Decoding:        %10.3fs\n", stats.time_decode / 1e9);
+	printf("  Classifying:     %10.3fs\n", stats.time_classify / 1e9);
+	printf("  Labelling:       %10.3fs\n", stats.time_label / 1e9);
+	printf("  Erasing:         %10.3fs\n", stats.time_erase / 1e9);
+	printf("  Tracing:         %10.3fs\n", stats.time_trace / 1e9);
+	printf("  Rules I/O:       %10.3fs\n", stats.time_rules / 1e9);
+	printf("  Pixels scanned:  %10llu\n", (unsigned long long)stats.pixels);
+	printf("  Polygons:        %10llu\n", (unsigned long long)stats.polygons);
+	printf("  Contour steps:   %10llu\n", (unsigned long long)stats.steps);
+	printf("  Rule lookups:    %10llu\n", (unsigned long long)stats.lookups);
+	printf("  Rules learned:   %10llu\n", (unsigned long long)stats.learned);
+	if (auto_rules)
+		printf("  Rules inferred:  %10i\n", (int)inferred_rules.size());
+	if (stats.largest)
+		printf("  Largest polygon: %10i vertices, at %i,%i\n", (int)stats.largest, stats.largest_at.x, stats.largest_at.y);
+#ifndef WIN32
+	struct rusage usage;
+	if (!getrusage(RUSAGE_SELF, &usage))
 	{
-		png_free(png_ptr, row);
-		row = NULL;
+#ifdef __APPLE__
+		// reported in bytes, rather than kilobytes
+		usage.ru_maxrss /= 1024;
+#endif
+		printf("  Peak memory:     %10.1fMB\n", usage.ru_maxrss / 1024.0);
 	}
-	if (png_ptr)
+#endif
+	if (several)
+		printf("Times spent tracing several colors at once are added together.\n");
+}
+
+// Options which apply to every image being traced
+struct trace_options
+{
+	int threads = 1;
+	int band = 0;
+	bool pipeline = false;
+	bool use_cache = true;
+	bool binary = false;
+};
+
+// Rules only get loaded once something actually needs tracing, and only once when tracing several images at a time
+// Returns false if they couldn't be loaded, in which case nothing can be traced
+bool need_rules()
+{
+	static std::once_flag once;
+	static bool loaded = false;
+	std::call_once(once, []()
 	{
-		if (info_ptr)
-			png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		else	png_destroy_read_struct(&png_ptr, NULL, NULL);
-		png_ptr = NULL;
-		info_ptr = NULL;
-	}
+		uint64_t rules_start = time_ns();
+		loaded = load_rules();
+		stats.time_rules += time_ns() - rules_start;
+	});
+	return loaded;
 }
 
-int main(int argc, const char **argv)
+// Decode one image and trace each of its colors, or just list its colors if there aren't any jobs
+// Leaves the jobs for trace_image() to clean up, however it turns out
+int decode_and_trace (const char *filename, std::vector<trace_job *> &jobs, const char *mode, const trace_options &opt)
 {
 	// File handles
 	FILE *in = NULL;
-	FILE *out = NULL;
 
 	// PNG parsing data
 	int result = 1;
@@ -546,35 +2426,87 @@ int main(int argc, const char **argv)
 	int channels;
 
 	// Color filter data
-	unsigned int color = 0xFFFFFFFF;
+	bool list_colors = jobs.empty();
 	std::set<unsigned int> colors;
+	row_classifier classifier(jobs);
 
-	if (argc < 2)
+	int band = opt.band;
+	bool pipeline = opt.pipeline;
+	bool use_cache = opt.use_cache;
+	uint64_t start = time_ns(), classify_time = 0, band_time = 0;
+
+	// Tracing threads for pipelined mode, one per color
+	std::vector<std::thread> tracers;
+	std::vector<img_run> runs;
+
+	// Decoded bitmap cache
+	cache_header key;
+	bool have_key = false, cached = false;
+
+	// Pipelined mode is just band mode with the decoding moved onto its own thread
+	if (pipeline && !band)
+		band = 64;
+	// Band mode never holds the whole bitmap, so there's nothing to cache and nothing to scan for holes
+	if (band && mode)
 	{
-		fprintf(stderr, "Usage: pngtrace <input.png> <RRGGBB> [output.txt]\n");
-		fprintf(stderr, "Specify a filename of '--hollow' to scan for hollow nodes.\n");
-		fprintf(stderr, "Specify a filename of '--holes' to trace inside all holes.\n");
+		fprintf(stderr, "pngtrace: '--band' and '--pipeline' can't be used with '%s'\n", mode);
 		return 1;
 	}
+	if (list_colors)
+	{
+		band = 0;
+		pipeline = false;
+	}
+	if (band)
+		use_cache = false;
+
+	// If every color has already been decoded from this exact image, skip straight to tracing
+	if (use_cache && !list_colors)
+		have_key = cache_key(filename, key);
+	if (have_key)
+	{
+		size_t loaded = 0;
+		while (loaded < jobs.size() && load_cache(filename, key, *jobs[loaded], colors))
+			loaded++;
+		if (loaded == jobs.size())
+		{
+			printf("Loaded cached image data...\n");
+			cached = true;
+			result = 0;
+			goto done;
+		}
+		for (size_t i = 0; i < loaded; i++)
+			jobs[i]->pixels.dealloc();
+		colors.clear();
+	}
 
-	in = fopen(argv[1], "rb");
+	in = fopen(filename, "rb");
 	if (!in)
 	{
-		fprintf(stderr, "pngtrace: could not open input file '%s', aborting.\n", argv[1]);
+		fprintf(stderr, "pngtrace: could not open input file '%s', aborting.\n", filename);
 		goto done;
 	}
 	printf("Loading image file...\n");
 
-	if (argc > 2)
-		color = std::strtoul(argv[2], nullptr, 16);
-
-	if (!readpng_init(in, png_ptr, info_ptr, width, height, channels, row))
+	if (!readpng_init(in, png_ptr, info_ptr, width, height, channels, row, classifier.palette))
 	{
 		fprintf(stderr, "pngtrace: error reading file\n");
 		goto done;
 	}
 
-	pixels.alloc(width, height);
+	// In band mode, polygons get written out while the image is still being decoded
+	if (band)
+	{
+		if (!need_rules() || !open_outputs(jobs, opt.binary))
+			goto done;
+		printf("Extracting polygons...\n");
+		for (size_t i = 0; pipeline && i < jobs.size(); i++)
+			tracers.push_back(std::thread([&jobs, i, band]() { jobs[i]->stream.run(jobs[i]->out, band); }));
+	}
+
+	for (size_t i = 0; i < jobs.size(); i++)
+		jobs[i]->pixels.alloc(width, band ? 1 : height);
+	classifier.init(width, channels);
 	for (int py = 0; py < height; py++)
 	{
 		if (!readpng_read_row(png_ptr, info_ptr, row))
@@ -582,31 +2514,64 @@ int main(int argc, const char **argv)
 			fprintf(stderr, "pngtrace: error reading image data\n");
 			goto done;
 		}
-		for (int px = 0; px < width; px++)
+		// mark each row in the canvas for each matching color
+		// if there are partially transparent pixels, make sure we don't actually start tracing - make them fix it first
+		uint64_t classify_start = time_ns();
+		if (classifier.classify(row, py, band ? 0 : py))
+			list_colors = true;
+		classify_time += time_ns() - classify_start;
+		stats.pixels += width;
+
+		if (band)
 		{
-			unsigned int c = get_rgb(channels, row, px);
-			if (c == 0xFFFFFFFF)
+			uint64_t label_start = time_ns();
+			for (size_t i = 0; i < jobs.size(); i++)
 			{
-				printf("Partially transparent pixel %06X detected at %i,%i\n", c & 0xFFFFFF, px, py);
-				// clear out input color so we don't actually start tracing - make them fix it first
-				color = 0xFFFFFFFF;
+				if (list_colors || (!pipeline && jobs[i]->stream.done()))
+					jobs[i]->pixels.clear_span(0, width, 0);
+				else if (pipeline)
+				{
+					img_stream::take_row(jobs[i]->pixels, runs);
+					jobs[i]->stream.push(runs, PIPELINE_ROWS);
+				}
+				else	jobs[i]->stream.add_row(jobs[i]->pixels);
 			}
-			// skip black pixels
-			if (c == 0)
-				continue;
-			// add it to our color list, and mark it in our canvas
-			colors.insert(c);
-			pixels.set(px, py, (color == c) || (color == 0));
+			uint64_t trace_start = time_ns();
+			if (!pipeline)
+				stats.time_label += trace_start - label_start;
+			for (size_t i = 0; !pipeline && !list_colors && (py + 1) % band == 0 && i < jobs.size(); i++)
+				jobs[i]->stream.process(jobs[i]->out);
+			if (!pipeline)
+				stats.time_trace += time_ns() - trace_start;
+			band_time += time_ns() - label_start;
 		}
 	}
 	// read and discard PNG footer
 	if (readpng_finish(png_ptr, info_ptr))
 		result = 0;
+	classifier.get_colors(colors);
 done:
+	// In band mode, finish tracing whatever's left, unless something went wrong
+	if (band)
+	{
+		uint64_t finish_start = time_ns();
+		bool discard = (result > 0) || list_colors;
+		for (size_t i = 0; i < tracers.size(); i++)
+			jobs[i]->stream.close(discard);
+		for (size_t i = 0; i < tracers.size(); i++)
+			tracers[i].join();
+		for (size_t i = 0; !pipeline && !discard && i < jobs.size(); i++)
+			jobs[i]->stream.finish(jobs[i]->out);
+		if (!pipeline)
+			stats.time_trace += time_ns() - finish_start;
+		band_time += time_ns() - finish_start;
+	}
 	// clean up everything
 	readpng_cleanup(png_ptr, info_ptr, row);
 	if (in)
 		fclose(in);
+	stats.time_decode += time_ns() - start - classify_time - band_time;
+	stats.time_classify += classify_time;
 
 	// if we didn't reach the footer successfully, bail out now
 	if (result > 0)
@@ -614,48 +2579,267 @@ done:
 
 	// if we didn't specify a color (or if we found a partially transparent pixel),
 	// print them all out so a proper one can be selected next run
-	if (color == 0xFFFFFFFF)
+	if (list_colors)
 	{
+		// Band mode will already have started writing the outputs
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			if (jobs[i]->out.file)
+			{
+				fclose(jobs[i]->out.file);
+				jobs[i]->out.file = NULL;
+				remove(jobs[i]->filename.c_str());
+			}
+		}
 		printf("Colors found:\n");
 		for (auto iter = colors.begin(); iter != colors.end(); iter++)
 			printf("* %06X\n", *iter);
-		return 0;
+		// if we were asked to trace something, it didn't happen
+		return jobs.empty() ? 0 : 1;
+	}
+
+	if (have_key && !cached)
+	{
+		for (size_t i = 0; i < jobs.size(); i++)
+			save_cache(filename, key, *jobs[i], colors);
 	}
 
-	if (argc > 3)
+	if (mode)
 	{
-		if (!strcmp(argv[3], "--hollow"))
+		if (!strcmp(mode, "--hollow"))
 		{
 			printf("Scanning for hollow nodes...\n");
-			pixels.doHollow();
+			jobs[0]->pixels.doHollow();
 			printf("Done!\n");
 			return 0;
 		}
-		if (!strcmp(argv[3], "--holes"))
+		if (!strcmp(mode, "--holes"))
 		{
 			printf("Tracing holes...\n");
-			pixels.doInvert();
+			jobs[0]->pixels.doInvert();
 		}
+	}
+
+	// In band mode, everything has already been traced while decoding
+	if (!band)
+	{
+		if (!need_rules() || !open_outputs(jobs, opt.binary))
+			return 1;
+
+		printf("Extracting polygons...\n");
+
+		if (jobs.size() == 1)
+			jobs[0]->pixels.doTrace(jobs[0]->out, opt.threads);
 		else
 		{
-			out = fopen(argv[3], "wt");
-			if (!out)
-			{
-				fprintf(stderr, "pngtrace: could not create output file '%s'\n", argv[2]);
-				return 1;
-			}
+			// Trace each color on its own thread
+			std::vector<std::thread> pool;
+			for (size_t i = 0; i < jobs.size(); i++)
+				pool.push_back(std::thread([&jobs, i, &opt]() { jobs[i]->pixels.doTrace(jobs[i]->out, opt.threads); }));
+			for (size_t i = 0; i < pool.size(); i++)
+				pool[i].join();
 		}
 	}
 
-	printf("Extracting polygons...\n");
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (jobs[i]->out.file)
+		{
+			bool ok = jobs[i]->out.finish();
+			if (fclose(jobs[i]->out.file) || !ok)
+				fprintf(stderr, "pngtrace: failed to write output file '%s'\n", jobs[i]->filename.c_str());
+			jobs[i]->out.file = NULL;
+		}
+	}
+	return 0;
+}
 
-	load_rules();
-	pixels.doTrace(out);
-	if (!discard_rules)
-		save_rules();
+// Same as decode_and_trace(), then free the jobs (and their bitmaps) whether it worked or not,
+// so a batch doesn't hang on to the images which failed until it's finished
+int trace_image (const char *filename, std::vector<trace_job *> &jobs, const char *mode, const trace_options &opt)
+{
+	int result = decode_and_trace(filename, jobs, mode, opt);
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		// anything still open didn't get finished
+		if (jobs[i]->out.file)
+			fclose(jobs[i]->out.file);
+		delete jobs[i];
+	}
+	jobs.clear();
+	return result;
+}
 
-	if (out)
-		fclose(out);
-	printf("\nDone!\n");
-	return 0;
+// One image from a batch manifest, along with the colors to trace from it
+struct trace_task
+{
+	std::string filename;
+	std::vector<trace_job *> jobs;
+	int result;
+};
+
+// Read a manifest listing one image per line, either as "<input.png> <RRGGBB> <output.txt>"
+// or as "<input.png> <RRGGBB=output.txt,RRGGBB=output.txt,...>" - blank lines and lines starting with '#' are skipped
+bool read_manifest (const char *manifest, std::vector<trace_task> &tasks)
+{
+	FILE *in = fopen(manifest, "rt");
+	if (!in)
+	{
+		fprintf(stderr, "pngtrace: could not open manifest '%s'\n", manifest);
+		return false;
+	}
+	char line[4096];
+	bool ok = true;
+	for (int num = 1; ok && fgets(line, sizeof(line), in); num++)
+	{
+		char image[1024], color[2048], output[1024];
+		int fields = sscanf(line, "%1023s %2047s %1023s", image, color, output);
+		if (fields <= 0 || image[0] == '#')
+			continue;
+		trace_task task;
+		task.filename = image;
+		task.result = 1;
+		if (fields == 2 && strchr(color, '='))
+			ok = parse_jobs(color, task.jobs);
+		else if (fields == 3 && !strchr(color, '='))
+			task.jobs.push_back(new trace_job(std::strtoul(color, nullptr, 16), output));
+		else	ok = false;
+		if (!ok)
+			fprintf(stderr, "pngtrace: invalid manifest entry on line %i\n", num);
+		else	tasks.push_back(task);
+	}
+	fclose(in);
+	return ok;
+}
+
+int main(int argc, const char **argv)
+{
+	int result = 1;
+	std::vector<trace_job *> jobs;
+
+	// Options
+	trace_options opt;
+	bool show_stats = false;
+	const char *mode = NULL;
+	const char *manifest = NULL;
+	int workers = std::max((int)std::thread::hardware_concurrency(), 1);
+
+	// Pull out any options, leaving just the positional arguments
+	int args = 0;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--threads") && (i + 1 < argc))
+			opt.threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--band") && (i + 1 < argc))
+			opt.band = std::max(atoi(argv[++i]), 1);
+		else if (!strcmp(argv[i], "--pipeline"))
+			opt.pipeline = true;
+		else if (!strcmp(argv[i], "--no-cache"))
+			opt.use_cache = false;
+		else if (!strcmp(argv[i], "--auto"))
+			auto_rules = true;
+		else if (!strcmp(argv[i], "--binary"))
+			opt.binary = true;
+		else if (!strcmp(argv[i], "--stats"))
+			show_stats = true;
+		else if (!strcmp(argv[i], "--manifest") && (i + 1 < argc))
+			manifest = argv[++i];
+		else if (!strcmp(argv[i], "--workers") && (i + 1 < argc))
+			workers = std::max(atoi(argv[++i]), 1);
+		else	argv[args++] = argv[i];
+	}
+	argc = args;
+
+	if (argc < 2 && !manifest)
+	{
+		fprintf(stderr, "Usage: pngtrace [--threads N] [--band N] [--pipeline] [--no-cache] [--auto] [--binary] [--stats] <input.png> <RRGGBB> [output.txt]\n");
+		fprintf(stderr, "       pngtrace [--threads N] [--band N] [--pipeline] [--no-cache] [--auto] [--binary] [--stats] <input.png> <RRGGBB=output.txt,RRGGBB=output.txt,...>\n");
+		fprintf(stderr, "       pngtrace [--workers N] [--threads N] [--band N] [--pipeline] [--no-cache] [--auto] [--binary] [--stats] --manifest <list.txt>\n");
+		fprintf(stderr, "Specify a filename of '--hollow' to scan for hollow nodes.\n");
+		fprintf(stderr, "Specify a filename of '--holes' to trace inside all holes.\n");
+		fprintf(stderr, "Specify '--threads N' to trace polygons using N worker threads.\n");
+		fprintf(stderr, "Specify '--band N' to only keep the rows still being traced in memory, tracing every N rows.\n");
+		fprintf(stderr, "Specify '--pipeline' to decode the image on its own thread, tracing in bands right behind it.\n");
+		fprintf(stderr, "Specify '--no-cache' to always decode the image, rather than using the cached bitmap.\n");
+		fprintf(stderr, "Specify '--auto' to infer unknown rules instead of asking, skipping nodes where that fails.\n");
+		fprintf(stderr, "Specify '--binary' to write polygons in the binary layer format.\n");
+		fprintf(stderr, "Specify '--stats' to report where the time went once finished.\n");
+		fprintf(stderr, "Specify '--manifest <list.txt>' to trace every image listed in a file, one per line, in either of the forms above.\n");
+		fprintf(stderr, "Specify '--workers N' to trace up to N images from the manifest at once.\n");
+		return 1;
+	}
+
+	bool several;
+	if (manifest)
+	{
+		std::vector<trace_task> tasks;
+		if (!read_manifest(manifest, tasks))
+			return 1;
+		// Each worker keeps taking the next image off the list until there aren't any left
+		std::atomic<size_t> next(0);
+		auto worker = [&]()
+		{
+			while (true)
+			{
+				size_t i = next++;
+				if (i >= tasks.size())
+					break;
+				printf("Tracing '%s'...\n", tasks[i].filename.c_str());
+				tasks[i].result = trace_image(tasks[i].filename.c_str(), tasks[i].jobs, NULL, opt);
+			}
+		};
+		std::vector<std::thread> pool;
+		for (int i = 0; i < std::min(workers, (int)tasks.size()); i++)
+			pool.push_back(std::thread(worker));
+		for (size_t i = 0; i < pool.size(); i++)
+			pool[i].join();
+
+		result = 0;
+		for (size_t i = 0; i < tasks.size(); i++)
+		{
+			if (!tasks[i].result)
+				continue;
+			fprintf(stderr, "pngtrace: failed to trace '%s'\n", tasks[i].filename.c_str());
+			result = 1;
+		}
+		several = true;
+	}
+	else
+	{
+		if (argc > 2)
+		{
+			if (strchr(argv[2], '='))
+			{
+				if (!parse_jobs(argv[2], jobs))
+					return 1;
+			}
+			else
+			{
+				std::string filename;
+				if (argc > 3)
+				{
+					if (!strcmp(argv[3], "--hollow") || !strcmp(argv[3], "--holes"))
+						mode = argv[3];
+					else	filename = argv[3];
+				}
+				jobs.push_back(new trace_job(std::strtoul(argv[2], nullptr, 16), filename));
+			}
+		}
+		several = jobs.size() > 1;
+		result = trace_image(argv[1], jobs, mode, opt);
+	}
+
+	// Rules only get saved once everything's finished, even when tracing several images at once
+	if (rules && (manifest || !result))
+	{
+		uint64_t rules_start = time_ns();
+		save_inferred();
+		if (!discard_rules)
+			save_rules();
+		stats.time_rules += time_ns() - rules_start;
+		printf("\nDone!\n");
+	}
+	if (show_stats && (manifest || !result))
+		print_stats(several);
+	return result;
 }
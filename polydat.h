@@ -0,0 +1,51 @@
+/*
+ * Binary Polygon Layer Format
+ * Written by pngtrace as an alternative to the text format, and loaded directly by readnodes
+ *
+ * Copyright (c) QMT Productions
+ */
+
+#ifndef POLYDAT_H
+#define POLYDAT_H
+
+#include <stdint.h>
+
+// A header, followed by num_polys polygon records, num_rings ring records, and num_vertices vertices.
+// Each polygon's first ring is its outer boundary, and any others are holes inside it.
+// Coordinates are stored exactly as traced, before any scaling or flipping.
+// Everything is 32-bit and in native byte order, so the whole file can simply be mapped into memory.
+const char polydat_magic[8] = {'P', 'T', 'P', 'O', 'L', 'Y', 'S', 1};
+
+struct polydat_header
+{
+	char magic[8];
+	uint32_t num_polys;
+	uint32_t num_rings;
+	uint32_t num_vertices;
+	uint32_t reserved;
+};
+
+struct polydat_poly
+{
+	uint32_t first_ring;
+	uint32_t num_rings;
+	// Bounding box of the outer boundary
+	int32_t xmin, ymin;
+	int32_t xmax, ymax;
+	// Area of the outer boundary, minus the area of any holes
+	int32_t area;
+	uint32_t reserved;
+};
+
+struct polydat_ring
+{
+	uint32_t first_vertex;
+	uint32_t num_vertices;
+};
+
+struct polydat_vertex
+{
+	int32_t x, y;
+};
+
+#endif // POLYDAT_H
@@ -23,9 +23,16 @@
 #define DOWNSCALE 1
 #endif
 
+#include <stdio.h>
+#include <string.h>
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #ifdef _MSC_VER
 typedef __int64 int64_t;
@@ -33,8 +40,12 @@ typedef __int64 int64_t;
 #include <inttypes.h>
 #include <climits>
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
+#include "polydat.h"
+
 struct rect
 {
 	int xmin, ymin;
@@ -64,67 +75,675 @@ struct vertex
 // Second segment is offset by (0.5,0.5) to ensure that the segments can never overlap
 bool intersect (const vertex &p1, const vertex &p2, const vertex &q1, const vertex &q2)
 {
-	int64_t d = 2 * ((q2.y - q1.y) * (p2.x - p1.x) - (q2.x - q1.x) * (p2.y - p1.y));
+	int64_t d = 2 * ((int64_t)(q2.y - q1.y) * (p2.x - p1.x) - (int64_t)(q2.x - q1.x) * (p2.y - p1.y));
 	if (d == 0)
 		return false;
 
-	int64_t _ua = (q2.x - q1.x) * (2 * (p1.y - q1.y) - 1) - (q2.y - q1.y) * (2 * (p1.x - q1.x) - 1);
-	int64_t _ub = (p2.x - p1.x) * (2 * (p1.y - q1.y) - 1) - (p2.y - p1.y) * (2 * (p1.x - q1.x) - 1);
+	int64_t _ua = (int64_t)(q2.x - q1.x) * (2 * (p1.y - q1.y) - 1) - (int64_t)(q2.y - q1.y) * (2 * (p1.x - q1.x) - 1);
+	int64_t _ub = (int64_t)(p2.x - p1.x) * (2 * (p1.y - q1.y) - 1) - (int64_t)(p2.y - p1.y) * (2 * (p1.x - q1.x) - 1);
+
+	// ua = _ua / d and ub = _ub / d, so flip the signs to make d positive
+	// and then compare the numerators against it directly rather than dividing
+	if (d < 0)
+	{
+		d = -d;
+		_ua = -_ua;
+		_ub = -_ub;
+	}
 
-	long double ua = (long double)_ua / (long double)d;
-	long double ub = (long double)_ub / (long double)d;
+	// Segments which only touch at an endpoint (ua or ub exactly 0 or 1) don't count,
+	// which also covers the case where the two segments overlap
+	return (_ua > 0) && (_ua < d) && (_ub > 0) && (_ub < d);
+}
 
-	// the two segments overlap - we should probably issue a warning if this happens, since it'll mess things up
-	if (((_ua == 0 || _ua == d) && (ub >= 0 && ub <= 1)) || ((_ub == 0 || _ub == d) && (ua >= 0 && ua <= 1)))
+// Same as intersect(), for segments which are both horizontal or vertical - parallel ones never cross,
+// and otherwise it's just a matter of whether each one lies strictly within the other one's span
+bool intersect_rectilinear (const vertex &p1, const vertex &p2, const vertex &q1, const vertex &q2)
+{
+	if (p1.y == p2.y)
+	{
+		// horizontal, so the other one must be vertical
+		if (q1.x != q2.x)
+			return false;
+		return (std::min(p1.x, p2.x) <= q1.x) && (q1.x < std::max(p1.x, p2.x)) && (std::min(q1.y, q2.y) < p1.y) && (p1.y <= std::max(q1.y, q2.y));
+	}
+	// vertical, so the other one must be horizontal
+	if (q1.y != q2.y)
 		return false;
+	return (std::min(p1.y, p2.y) <= q1.y) && (q1.y < std::max(p1.y, p2.y)) && (std::min(q1.x, q2.x) < p1.x) && (p1.x <= std::max(q1.x, q2.x));
+}
 
-	if ((ua > 0) && (ua < 1) && (ub > 0) && (ub < 1))
-		return true;
+// What sort of edges a polygon has (including its holes), worked out when it's loaded
+// so the overlap and containment checks can use simpler versions of themselves
+#define SHAPE_RECTILINEAR	0	// only horizontal and vertical edges
+#define SHAPE_OCTILINEAR	1	// 45-degree diagonals as well
+#define SHAPE_GENERAL		2	// anything else
 
-	return false;
+// Check if two segments intersect, using whichever version of intersect() suits the polygons they came from
+template<int shape>
+bool intersect_shape (const vertex &p1, const vertex &p2, const vertex &q1, const vertex &q2)
+{
+	if (shape == SHAPE_RECTILINEAR)
+		return intersect_rectilinear(p1, p2, q1, q2);
+	return intersect(p1, p2, q1, q2);
 }
 
+// A polygon's vertices - either a view of a ring stored in one of the layer arenas below,
+// or a list of its own (once it gets modified, or when it's built up one vertex at a time)
+class vertex_list
+{
+	const vertex *first;
+	size_t count;
+	std::vector<vertex> own;
+public:
+	vertex_list () : first(NULL), count(0) { }
+	// Views are shared, since the arenas are never freed
+	vertex_list (const vertex_list &copy) : first(copy.first), count(copy.count), own(copy.own)
+	{
+		if (own.size())
+			first = &own[0];
+	}
+	vertex_list &operator= (const vertex_list &copy)
+	{
+		own = copy.own;
+		first = own.size() ? &own[0] : copy.first;
+		count = copy.count;
+		return *this;
+	}
+	void view (const vertex *v, size_t n)
+	{
+		own.clear();
+		first = v;
+		count = n;
+	}
+	// Get a copy of the vertices which can be changed
+	vertex *modify ()
+	{
+		// still viewing an arena?
+		if (own.size() != count)
+			own.assign(first, first + count);
+		first = count ? &own[0] : NULL;
+		return count ? &own[0] : NULL;
+	}
+	void push_back (const vertex &v)
+	{
+		modify();
+		own.push_back(v);
+		first = &own[0];
+		count = own.size();
+	}
+	size_t size () const
+	{
+		return count;
+	}
+	const vertex &operator[] (size_t i) const
+	{
+		return first[i];
+	}
+};
+
+// Storage for all of the vertices loaded from layer files, one arena per file, kept until the program exits
+std::deque<std::vector<vertex> > &vertex_arenas ()
+{
+	static std::deque<std::vector<vertex> > arenas;
+	return arenas;
+}
+
+// Polygons with at least this many vertices (including holes) get an edge index for isInside()
+#ifndef EDGE_INDEX_MIN
+#define EDGE_INDEX_MIN 64
+#endif
+
 class polygon
 {
 protected:
-	std::vector<vertex> vertices;
+	vertex_list vertices;
+	// Inner boundaries, for nodes with holes in them
+	std::vector<polygon> holes;
+	// One of the SHAPE_* values
+	int shape;
+
+	// Every edge (including those of holes) listed under each band of rows it passes through,
+	// so isInside() and collides() only need to look at the edges near the point (or the other
+	// polygon) rather than all of them
+	// Built the first time it's needed, and thrown away whenever the polygon changes
+	// (and never copied along with the polygon, since it points into the polygon's own vertices)
+	struct edge_index
+	{
+		int xmin, ymin, xmax, ymax;
+		// Each band is (1 << shift) rows tall
+		int shift;
+		// Where each band's edges start, plus one extra entry for the end of the last one
+		std::vector<int> start;
+		// First vertex of each edge - the second one always comes right after it
+		std::vector<const vertex *> edges;
+	};
+	// Only allocated for polygons which need one, to keep the rest small
+	mutable edge_index *index;
+
+	// The polygon (minus its holes) cut into horizontal trapezoids, one slab at a time between
+	// each pair of vertex rows, so collides() can compare two polygons piece by piece
+	// Each piece is kept as its bounding box, which is the piece itself for rectilinear polygons
+	// Built the first time collides() needs it, and thrown away along with the edge index
+	struct trapezoid_list
+	{
+		// Slab i covers rows y[i] through y[i+1], and its pieces start at start[i], from left to right
+		std::vector<int> y;
+		std::vector<int> start;
+		std::vector<rect> pieces;
+	};
+	mutable trapezoid_list *trapezoids;
+
+	void dropIndex () const
+	{
+		delete index;
+		index = NULL;
+		delete trapezoids;
+		trapezoids = NULL;
+	}
+
+	int totalVertices () const
+	{
+		int count = numVertices();
+		for (int i = 0; i < holes.size(); i++)
+			count += holes[i].numVertices();
+		return count;
+	}
+	// File each of a ring's edges under the bands it passes through
+	// The first pass just counts them, and the second one fills them in
+	void indexRing (const polygon &ring, std::vector<int> &pos, bool fill) const
+	{
+		for (int i = 0; i < ring.numVertices(); i++)
+		{
+			const vertex &p1 = ring.vertices[i];
+			const vertex &p2 = ring.vertices[i + 1];
+			// horizontal edges only go in the band they're in
+			int b0 = (std::min(p1.y, p2.y) - index->ymin) >> index->shift;
+			int b1 = (std::max(std::max(p1.y, p2.y) - 1, std::min(p1.y, p2.y)) - index->ymin) >> index->shift;
+			for (int b = b0; b <= b1; b++)
+			{
+				if (fill)
+					index->edges[pos[b]++] = &p1;
+				else	pos[b + 1]++;
+			}
+		}
+	}
+	void buildIndex () const
+	{
+		rect bbox;
+		bRect(bbox);
+		index = new edge_index;
+		index->xmin = bbox.xmin;
+		index->ymin = bbox.ymin;
+		index->xmax = bbox.xmax;
+		index->ymax = bbox.ymax;
+		// aim for around 8 edges per band
+		int bands = std::max(totalVertices() / 8, 1);
+		index->shift = 0;
+		while (((bbox.ymax - bbox.ymin) >> index->shift) >= bands)
+			index->shift++;
+		bands = ((bbox.ymax - bbox.ymin) >> index->shift) + 1;
+
+		index->start.assign(bands + 1, 0);
+		indexRing(*this, index->start, false);
+		for (int i = 0; i < holes.size(); i++)
+			indexRing(holes[i], index->start, false);
+		for (int b = 0; b < bands; b++)
+			index->start[b + 1] += index->start[b];
+		index->edges.resize(index->start[bands]);
+		std::vector<int> pos(index->start.begin(), index->start.end() - 1);
+		indexRing(*this, pos, true);
+		for (int i = 0; i < holes.size(); i++)
+			indexRing(holes[i], pos, true);
+	}
+	// Same as crossings() for a point inside the index, but using a horizontal ray so only the
+	// edges in the point's band need checking - returns -1 if an edge passes exactly through the point
+	template<int shape>
+	int indexedCrossings (const vertex &q) const
+	{
+		int band = (q.y - index->ymin) >> index->shift;
+		int count = 0;
+		for (int i = index->start[band]; i < index->start[band + 1]; i++)
+		{
+			const vertex &p1 = index->edges[i][0];
+			const vertex &p2 = index->edges[i][1];
+			// does it cross the row at y+0.5? (horizontal ones never do)
+			if ((p1.y <= q.y) == (p2.y <= q.y))
+				continue;
+			// and if so, is it to the right of x+0.5?
+			if ((shape == SHAPE_RECTILINEAR) || (p1.x == p2.x))
+			{
+				// vertical edges can't pass through the point
+				if (p1.x > q.x)
+					count++;
+				continue;
+			}
+			if (shape == SHAPE_OCTILINEAR)
+			{
+				// at 45 degrees, the slope cancels out of the general version below
+				int side = 2 * (p1.x - q.x) - 1 + (((p2.x > p1.x) == (p2.y > p1.y)) ? 1 : -1) * (2 * (q.y - p1.y) + 1);
+				if (side == 0)
+					return -1;
+				if (side > 0)
+					count++;
+				continue;
+			}
+			int64_t side = (int64_t)(2 * (p1.x - q.x) - 1) * (p2.y - p1.y) + (int64_t)(p2.x - p1.x) * (2 * (q.y - p1.y) + 1);
+			if (side == 0)
+				return -1;
+			if ((side > 0) == (p2.y > p1.y))
+				count++;
+		}
+		return count;
+	}
+
+	// Orders edges by where they cross a particular row (given doubled, so it can be halfway between two)
+	struct edge_order
+	{
+		int y2;
+		edge_order (int _y2) : y2(_y2) { }
+		// Twice the edge's X coordinate at that row, as a fraction with a positive denominator
+		void at (const vertex *v, int64_t &num, int64_t &den) const
+		{
+			int dx = v[1].x - v[0].x, dy = v[1].y - v[0].y;
+			if (dy < 0)
+			{
+				dx = -dx;
+				dy = -dy;
+			}
+			num = (int64_t)2 * v[0].x * dy + (int64_t)(y2 - 2 * v[0].y) * dx;
+			den = dy;
+		}
+		bool operator() (const vertex *a, const vertex *b) const
+		{
+			int64_t na, da, nb, db;
+			at(a, na, da);
+			at(b, nb, db);
+			return na * db < nb * da;
+		}
+	};
+	// Where an edge crosses a row, rounded down (or up)
+	static int edgeX (const vertex *v, int y, bool up)
+	{
+		int64_t num = (int64_t)(y - v[0].y) * (v[1].x - v[0].x);
+		int64_t den = v[1].y - v[0].y;
+		if (den < 0)
+		{
+			num = -num;
+			den = -den;
+		}
+		int64_t x = num / den;
+		if ((num % den) && ((num > 0) == up))
+			x += up ? 1 : -1;
+		return v[0].x + (int)x;
+	}
+	void buildTrapezoids () const
+	{
+		trapezoids = new trapezoid_list;
+		// horizontal edges only ever separate one slab from the next
+		std::vector<const vertex *> edges;
+		std::vector<int> &rows = trapezoids->y;
+		for (int r = -1; r < (int)holes.size(); r++)
+		{
+			const polygon &ring = (r < 0) ? *this : holes[r];
+			for (int i = 0; i < ring.numVertices(); i++)
+			{
+				rows.push_back(ring.vertices[i].y);
+				if (ring.vertices[i].y != ring.vertices[i + 1].y)
+					edges.push_back(&ring.vertices[i]);
+			}
+		}
+		std::sort(rows.begin(), rows.end());
+		rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+		std::vector<std::pair<int, const vertex *> > byTop;
+		for (int i = 0; i < edges.size(); i++)
+			byTop.push_back(std::make_pair(std::min(edges[i][0].y, edges[i][1].y), edges[i]));
+		std::sort(byTop.begin(), byTop.end());
+
+		std::vector<const vertex *> active;
+		int next = 0;
+		for (int s = 0; s + 1 < (int)rows.size(); s++)
+		{
+			int y0 = rows[s], y1 = rows[s + 1];
+			int kept = 0;
+			for (int i = 0; i < active.size(); i++)
+				if (std::max(active[i][0].y, active[i][1].y) > y0)
+					active[kept++] = active[i];
+			active.resize(kept);
+			while ((next < byTop.size()) && (byTop[next].first <= y0))
+				active.push_back(byTop[next++].second);
+			// edges can't cross each other, so their order halfway down the slab holds for all of it
+			std::sort(active.begin(), active.end(), edge_order(y0 + y1));
+			trapezoids->start.push_back(trapezoids->pieces.size());
+			for (int i = 0; i + 1 < active.size(); i += 2)
+			{
+				rect piece;
+				piece.xmin = std::min(edgeX(active[i], y0, false), edgeX(active[i], y1, false));
+				piece.xmax = std::max(edgeX(active[i + 1], y0, true), edgeX(active[i + 1], y1, true));
+				piece.ymin = y0;
+				piece.ymax = y1;
+				trapezoids->pieces.push_back(piece);
+			}
+		}
+		trapezoids->start.push_back(trapezoids->pieces.size());
+	}
+	// Check if a piece comes near any of the polygon's own pieces - it counts if the two touch
+	// once either one is offset by (0.5,0.5), the same way intersect() and isInside() look at them
+	bool touchesPiece (const rect &piece) const
+	{
+		const std::vector<int> &rows = trapezoids->y;
+		// first slab which reaches down to the piece
+		int s = std::lower_bound(rows.begin(), rows.end(), piece.ymin) - rows.begin();
+		if (s)
+			s--;
+		for (; (s + 1 < rows.size()) && (rows[s] <= piece.ymax); s++)
+		{
+			std::vector<rect>::const_iterator i = trapezoids->pieces.begin() + trapezoids->start[s];
+			std::vector<rect>::const_iterator end = trapezoids->pieces.begin() + trapezoids->start[s + 1];
+			// pieces in a slab are in order from left to right, by either side
+			int lo = 0, hi = end - i;
+			while (lo < hi)
+			{
+				int mid = (lo + hi) / 2;
+				if (i[mid].xmax < piece.xmin)
+					lo = mid + 1;
+				else	hi = mid;
+			}
+			for (i += lo; (i != end) && (i->xmin <= piece.xmax); i++)
+			{
+				if ((piece.xmin < i->xmax) && (i->xmin <= piece.xmax) && (piece.ymin < i->ymax) && (i->ymin <= piece.ymax))
+					return true;
+				if ((i->xmin < piece.xmax) && (piece.xmin <= i->xmax) && (i->ymin < piece.ymax) && (piece.ymin <= i->ymax))
+					return true;
+			}
+		}
+		return false;
+	}
+	// Check if any of the polygon's pieces come near any of another polygon's pieces,
+	// looking up the other polygon's pieces for whichever of the two has fewer of them
+	bool trapezoidsTouch (const polygon &other, const rect &mine, const rect &theirs) const
+	{
+		if (!trapezoids)
+			buildTrapezoids();
+		if (!other.trapezoids)
+			other.buildTrapezoids();
+		const polygon &a = (trapezoids->pieces.size() <= other.trapezoids->pieces.size()) ? *this : other;
+		const polygon &b = (&a == this) ? other : *this;
+		const rect &near = (&a == this) ? theirs : mine;
+		const std::vector<int> &rows = a.trapezoids->y;
+		int s = std::lower_bound(rows.begin(), rows.end(), near.ymin) - rows.begin();
+		if (s)
+			s--;
+		for (; (s + 1 < rows.size()) && (rows[s] <= near.ymax); s++)
+		{
+			for (int i = a.trapezoids->start[s]; i < a.trapezoids->start[s + 1]; i++)
+			{
+				const rect &piece = a.trapezoids->pieces[i];
+				if ((piece.xmin > near.xmax) || (piece.xmax < near.xmin))
+					continue;
+				if (b.touchesPiece(piece))
+					return true;
+			}
+		}
+		return false;
+	}
+
+	// One edge from either polygon, for collides()
+	struct sweep_edge
+	{
+		const vertex *v;
+		int xmin, ymin, xmax, ymax;
+		bool mine, outer;
+		bool operator< (const sweep_edge &other) const
+		{
+			return ymin < other.ymin;
+		}
+	};
+	void addSweepEdge (std::vector<sweep_edge> &edges, const vertex *v, bool mine, bool outer, const rect &bbox) const
+	{
+		sweep_edge e;
+		e.v = v;
+		e.xmin = std::min(v[0].x, v[1].x);
+		e.ymin = std::min(v[0].y, v[1].y);
+		e.xmax = std::max(v[0].x, v[1].x);
+		e.ymax = std::max(v[0].y, v[1].y);
+		if ((e.xmin > bbox.xmax) || (e.xmax < bbox.xmin) || (e.ymin > bbox.ymax) || (e.ymax < bbox.ymin))
+			return;
+		e.mine = mine;
+		e.outer = outer;
+		edges.push_back(e);
+	}
+	// Collect every edge (including those of holes) which touches the given rectangle
+	void sweepEdges (std::vector<sweep_edge> &edges, bool mine, const rect &bbox) const
+	{
+		if (!index)
+		{
+			for (int i = 0; i < numVertices(); i++)
+				addSweepEdge(edges, &vertices[i], mine, true, bbox);
+			for (int i = 0; i < holes.size(); i++)
+				for (int j = 0; j < holes[i].numVertices(); j++)
+					addSweepEdge(edges, &holes[i].vertices[j], mine, false, bbox);
+			return;
+		}
+		// edges are filed under the bands for rows ymin through ymax-1, so start one row early,
+		// and only take each one from the first of its bands which we look at
+		int b0 = std::max(bbox.ymin - 1 - index->ymin, 0) >> index->shift;
+		int b1 = (std::min(bbox.ymax, index->ymax) - index->ymin) >> index->shift;
+		for (int b = b0; b <= b1; b++)
+		{
+			for (int i = index->start[b]; i < index->start[b + 1]; i++)
+			{
+				const vertex *v = index->edges[i];
+				if (b != std::max(b0, (std::min(v[0].y, v[1].y) - index->ymin) >> index->shift))
+					continue;
+				bool outer = (v >= &vertices[0]) && (v < &vertices[0] + vertices.size());
+				addSweepEdge(edges, v, mine, outer, bbox);
+			}
+		}
+	}
+	void getBounds (rect &bbox) const
+	{
+		if (totalVertices() >= EDGE_INDEX_MIN)
+		{
+			if (!index)
+				buildIndex();
+			bbox.xmin = index->xmin;
+			bbox.ymin = index->ymin;
+			bbox.xmax = index->xmax;
+			bbox.ymax = index->ymax;
+		}
+		else	bRect(bbox);
+	}
+
+	// Count how many of the polygon's edges (including those of its holes) a segment crosses
+	int crossings (const vertex &q1, const vertex &q2) const
+	{
+		int count = 0;
+		for (int i = 0; i < numVertices(); i++)
+		{
+			const vertex &p1 = vertices[i];
+			const vertex &p2 = vertices[i + 1];
+			if (intersect(p1, p2, q1, q2))
+				count++;
+		}
+		for (int i = 0; i < holes.size(); i++)
+			count += holes[i].crossings(q1, q2);
+		return count;
+	}
+	// Check if any of the polygon's outer edges cross any of another polygon's outer edges
+	template<int shape>
+	bool edgesCross (const polygon &other) const
+	{
+		for (int i = 0; i < numVertices(); i++)
+		{
+			const vertex &p1 = vertices[i];
+			const vertex &p2 = vertices[i + 1];
+			for (int j = 0; j < other.numVertices(); j++)
+			{
+				const vertex &q1 = other.vertices[j];
+				const vertex &q2 = other.vertices[j + 1];
+				if (intersect_shape<shape>(p1, p2, q1, q2))
+					return true;
+			}
+		}
+		return false;
+	}
+	// Same as edgesCross(), but including the edges of both polygons' holes
+	template<int shape>
+	bool anyEdgesCross (const polygon &other) const
+	{
+		if (edgesCross<shape>(other))
+			return true;
+		for (int i = 0; i < holes.size(); i++)
+			if (holes[i].edgesCross<shape>(other))
+				return true;
+		for (int j = 0; j < other.holes.size(); j++)
+		{
+			if (edgesCross<shape>(other.holes[j]))
+				return true;
+			for (int i = 0; i < holes.size(); i++)
+				if (holes[i].edgesCross<shape>(other.holes[j]))
+					return true;
+		}
+		return false;
+	}
+	// The sweep from collides(), with the edges already sorted
+	template<int shape>
+	static bool sweepCross (const std::vector<sweep_edge> &edges)
+	{
+		std::vector<const sweep_edge *> active[2];
+		for (int i = 0; i < edges.size(); i++)
+		{
+			const sweep_edge &e = edges[i];
+			std::vector<const sweep_edge *> &against = active[!e.mine];
+			int kept = 0;
+			for (int j = 0; j < against.size(); j++)
+			{
+				const sweep_edge &o = *against[j];
+				// once an edge is above this one, it's above all the rest too
+				if (o.ymax < e.ymin)
+					continue;
+				against[kept++] = &o;
+				if ((o.xmin > e.xmax) || (e.xmin > o.xmax))
+					continue;
+				if (intersect_shape<shape>(e.v[0], e.v[1], o.v[0], o.v[1]) || intersect_shape<shape>(o.v[0], o.v[1], e.v[0], e.v[1]))
+					return true;
+			}
+			against.resize(kept);
+			active[e.mine].push_back(&e);
+		}
+		return false;
+	}
 public:
-	polygon() {}
-	polygon (const polygon &copy)
+	polygon () : shape(SHAPE_GENERAL), index(NULL), trapezoids(NULL) { }
+	polygon (const polygon &copy) : vertices(copy.vertices), holes(copy.holes), shape(copy.shape), index(NULL), trapezoids(NULL) { }
+	polygon &operator= (const polygon &copy)
+	{
+		dropIndex();
+		vertices = copy.vertices;
+		holes = copy.holes;
+		shape = copy.shape;
+		return *this;
+	}
+	~polygon ()
 	{
-		for (int i = 0; i < copy.vertices.size(); i++)
-			add(copy.vertices[i].x, copy.vertices[i].y);
+		dropIndex();
 	}
-	// Add a vertex to the polygon
+	// Add a vertex to the polygon, or to its most recent hole
 	void add (const int x, const int y)
 	{
-		vertices.push_back(vertex(x,y));
+		dropIndex();
+		if (holes.size())
+			holes.back().add(x, y);
+		else	vertices.push_back(vertex(x,y));
+	}
+	// Point the polygon (or its most recent hole) at a ring of vertices stored elsewhere,
+	// which must already have its first vertex copied to the end, as finish() would have done
+	void attach (const vertex *v, int count)
+	{
+		dropIndex();
+		if (holes.size())
+			holes.back().attach(v, count);
+		else	vertices.view(v, count);
+	}
+	// Start a new hole - all vertices added after this belong to it
+	void addHole ()
+	{
+		dropIndex();
+		holes.push_back(polygon());
 	}
 	// Copy the first vertex to the end - makes it easier to iterate across them
 	void finish ()
 	{
+		dropIndex();
 		vertices.push_back(vertices[0]);
+		for (int i = 0; i < holes.size(); i++)
+			holes[i].finish();
+		classify();
+	}
+	// Work out what sort of edges the polygon has - done by finish(), or by whoever attached its vertices
+	void classify ()
+	{
+		shape = SHAPE_RECTILINEAR;
+		for (int i = 0; i < numVertices(); i++)
+		{
+			int dx = vertices[i + 1].x - vertices[i].x;
+			int dy = vertices[i + 1].y - vertices[i].y;
+			if (dx && dy)
+				shape = std::max(shape, ((dx == dy) || (dx == -dy)) ? SHAPE_OCTILINEAR : SHAPE_GENERAL);
+		}
+		for (int i = 0; i < holes.size(); i++)
+		{
+			holes[i].classify();
+			shape = std::max(shape, holes[i].shape);
+		}
 	}
 	int numVertices () const
 	{
 		return vertices.size() - 1;
 	}
+	int numHoles () const
+	{
+		return holes.size();
+	}
+	// Vertex i of the outer boundary - vertex numVertices() is the first one again, as with finish()
+	const vertex &getVertex (int i) const
+	{
+		return vertices[i];
+	}
+	const polygon &getHole (int i) const
+	{
+		return holes[i];
+	}
 
-	// Check if a particular point is located inside the polygon
+	// Check if a particular point is located inside the polygon (and not inside one of its holes)
 	bool isInside (const vertex &q1) const
 	{
-		int winding_number = 0;
-		// distant point at a slight angle
-		const vertex q2(q1.x + 32768, q1.y + 128);
-
-		for (int i = 0; i < numVertices(); i++)
+		// For large polygons, count crossings along a horizontal ray instead, using the index
+		// Neither ray can pass through a vertex, so both give the same answer as long as the
+		// slanted one ends up outside the polygon and nothing passes exactly through the point
+		if (totalVertices() >= EDGE_INDEX_MIN)
 		{
-			const vertex &p1 = vertices[i];
-			const vertex &p2 = vertices[i + 1];
-			if (intersect(p1, p2, q1, q2))
-				winding_number++;
+			if (!index)
+				buildIndex();
+			if (q1.x + 32768 > index->xmax)
+			{
+				if ((q1.y < index->ymin) || (q1.y >= index->ymax))
+					return false;
+				int count;
+				switch (shape)
+				{
+				case SHAPE_RECTILINEAR:	count = indexedCrossings<SHAPE_RECTILINEAR>(q1);	break;
+				case SHAPE_OCTILINEAR:	count = indexedCrossings<SHAPE_OCTILINEAR>(q1);	break;
+				default:		count = indexedCrossings<SHAPE_GENERAL>(q1);	break;
+				}
+				if (count >= 0)
+					return (count & 1);
+			}
 		}
-		return (winding_number & 1);
+		// distant point at a slight angle
+		const vertex q2(q1.x + 32768, q1.y + 128);
+		return (crossings(q1, q2) & 1);
 	}
 
 	// Check if the second polygon intersects with the first one
@@ -137,31 +756,66 @@ public:
 				return true;
 
 		// if not, then see if any of its segments intersect with any of mine
-		for (int i = 0; i < numVertices(); i++)
+		// (including the edges of any holes, since it could be sitting partway inside one)
+		if (std::max(shape, other.shape) == SHAPE_RECTILINEAR)
+			return anyEdgesCross<SHAPE_RECTILINEAR>(other);
+		return anyEdgesCross<SHAPE_GENERAL>(other);
+	}
+
+	// Check if two polygons intersect, in either direction - the same as overlaps() both ways round,
+	// but only looking at the edges near the other polygon, and sweeping down through them both
+	// so that each edge is only compared against the other polygon's edges in the same rows
+	bool collides (const polygon &other) const
+	{
+		rect mine, theirs;
+		getBounds(mine);
+		other.getBounds(theirs);
+		if ((mine.xmin > theirs.xmax) || (theirs.xmin > mine.xmax) || (mine.ymin > theirs.ymax) || (theirs.ymin > mine.ymax))
+			return false;
+		// isInside() needs to be sure the ray from any vertex ends up outside the other polygon
+		// before vertices outside its bounding box can be skipped
+		if ((theirs.xmin + 32768 <= mine.xmax) || (mine.xmin + 32768 <= theirs.xmax))
+			return overlaps(other) || other.overlaps(*this);
+
+		// Two polygons collide exactly when their pieces do - those are only approximate
+		// for anything other than rectilinear polygons, but they can still rule it out
+		if (!trapezoidsTouch(other, mine, theirs))
+			return false;
+		if (std::max(shape, other.shape) == SHAPE_RECTILINEAR)
+			return true;
+
+		std::vector<sweep_edge> edges;
+		sweepEdges(edges, true, theirs);
+		other.sweepEdges(edges, false, mine);
+
+		// Any outer vertex inside the other polygon must be at the start of one of these edges
+		for (int i = 0; i < edges.size(); i++)
 		{
-			const vertex &p1 = vertices[i];
-			const vertex &p2 = vertices[i + 1];
-			for (int j = 0; j < other.numVertices(); j++)
-			{
-				const vertex &q1 = other.vertices[j];
-				const vertex &q2 = other.vertices[j + 1];
-				if (intersect(p1, p2, q1, q2))
-					return true;
-			}
+			const sweep_edge &e = edges[i];
+			if (e.outer && (e.mine ? other.isInside(*e.v) : isInside(*e.v)))
+				return true;
 		}
-		return false;
+
+		std::sort(edges.begin(), edges.end());
+		if (std::max(shape, other.shape) == SHAPE_RECTILINEAR)
+			return sweepCross<SHAPE_RECTILINEAR>(edges);
+		return sweepCross<SHAPE_GENERAL>(edges);
 	}
 
 	// Move the polygon
 	void move (const int x, const int y)
 	{
+		dropIndex();
 		// Using vertices.size() instead of numVertices()
 		// because need to hit the duplicate vertex at the end
+		vertex *v = vertices.modify();
 		for (int i = 0; i < vertices.size(); i++)
 		{
-			vertices[i].x += x;
-			vertices[i].y += y;
+			v[i].x += x;
+			v[i].y += y;
 		}
+		for (int i = 0; i < holes.size(); i++)
+			holes[i].move(x, y);
 	}
 
 	// Calculate the polygon's bounding box
@@ -202,7 +856,7 @@ public:
 			o1.y += d;
 			o2.y -= d;
 		}
-		else if (((v2.y - v1.y) / (double)(v2.x - v1.x)) > 0)
+		else if ((v2.y > v1.y) == (v2.x > v1.x))
 		{
 			// positive slope
 			o0.x -= 1; o0.y += 1;
@@ -219,10 +873,16 @@ public:
 		if (isInside(o0))
 			out = o2;
 		else	out = o1;
+		// horizontal and vertical ones don't need a square root
+		if ((v1.x == v2.x) || (v1.y == v2.y))
+		{
+			int len = (v2.x - v1.x) + (v2.y - v1.y);
+			return (len < 0) ? -len : len;
+		}
 		return sqrt((long double)((v2.y - v1.y) * (v2.y - v1.y) + (v2.x - v1.x) * (v2.x - v1.x)));
 	}
 
-	// Calculate the area of the polygon
+	// Calculate the area of the polygon, minus the area of its holes
 	int area () const
 	{
 		int a = 0;
@@ -234,10 +894,14 @@ public:
 		}
 		if (a < 0)
 			a = -a;
-		return a / 2;
+		a /= 2;
+		for (int i = 0; i < holes.size(); i++)
+			a -= holes[i].area();
+		return a;
 	}
 
 	// Generate a string containing a list of the polygon's vertex coordinates
+	// Only the outer boundary is included, since ChipSim has no way to represent holes
 	std::string toString () const
 	{
 		std::string output;
@@ -276,9 +940,17 @@ struct node
 		pull = '-';
 		layer = -1;
 	}
+	// Check if two nodes touch each other
 	bool collide (node *other)
 	{
 		// Do bounding box check before performing complicated polygon overlap check
+		if ((bbox.xmin > other->bbox.xmax) || (other->bbox.xmin > bbox.xmax) || (bbox.ymin > other->bbox.ymax) || (other->bbox.ymin > bbox.ymax))
+			return false;
+		return poly.collides(other->poly);
+	}
+	// Same as collide(), but only checking one way round (with the other node as the smaller one)
+	bool overlaps (node *other)
+	{
 		if ((bbox.xmin > other->bbox.xmax) || (other->bbox.xmin > bbox.xmax) || (bbox.ymin > other->bbox.ymax) || (other->bbox.ymin > bbox.ymax))
 			return false;
 		return poly.overlaps(other->poly);
@@ -323,42 +995,336 @@ struct transistor : public node
 	}
 };
 
-// Read vertex list for a particular layer and generate node definitions
-template<class T>
-bool readnodes (const char *filename, std::vector<T *> &nodes, int layer, int force_id = -1)
+// Packed R-tree over the bounding boxes of a range of nodes, so that collision searches only need
+// to look at the nodes near whatever they're searching around rather than every one of them
+// The nodes are sorted into slices by X and then by Y within each slice (sort-tile-recursive),
+// then packed NODE_INDEX_FANOUT to a box, and the same again for each level above that
+#define NODE_INDEX_FANOUT 16
+
+class node_index
 {
-	printf("Reading file: %s\n", filename);
-	FILE *in = fopen(filename, "rt");
-	if (!in)
+	// Each level's boxes, from one per node at the bottom up to a single one around all of them
+	// Box i on each level covers boxes i * NODE_INDEX_FANOUT onwards on the level below
+	std::vector<std::vector<rect> > levels;
+	// Which node each of the bottom level's boxes came from
+	std::vector<size_t> which;
+
+	struct entry
 	{
-		fprintf(stderr, "Failed to open file '%s'!\n", filename);
-		return false;
+		rect box;
+		size_t pos;
+	};
+	static bool byX (const entry &a, const entry &b)
+	{
+		return (a.box.xmin + a.box.xmax) < (b.box.xmin + b.box.xmax);
+	}
+	static bool byY (const entry &a, const entry &b)
+	{
+		return (a.box.ymin + a.box.ymax) < (b.box.ymin + b.box.ymax);
+	}
+	void search (int level, size_t i, const rect &r, std::vector<size_t> &found) const
+	{
+		const rect &box = levels[level][i];
+		if ((box.xmin > r.xmax) || (r.xmin > box.xmax) || (box.ymin > r.ymax) || (r.ymin > box.ymax))
+			return;
+		if (!level)
+		{
+			found.push_back(which[i]);
+			return;
+		}
+		size_t end = std::min((i + 1) * NODE_INDEX_FANOUT, levels[level - 1].size());
+		for (size_t j = i * NODE_INDEX_FANOUT; j < end; j++)
+			search(level - 1, j, r, found);
+	}
+public:
+	// Index nodes[start] through nodes[end - 1]
+	template<class T>
+	node_index (const std::vector<T *> &nodes, size_t start, size_t end)
+	{
+		std::vector<entry> entries(end - start);
+		for (size_t i = start; i < end; i++)
+		{
+			entries[i - start].box = nodes[i]->bbox;
+			entries[i - start].pos = i;
+		}
+		size_t leaves = (entries.size() + NODE_INDEX_FANOUT - 1) / NODE_INDEX_FANOUT;
+		size_t slices = (size_t)ceil(sqrt((double)leaves));
+		size_t per_slice = std::max(slices, (size_t)1) * NODE_INDEX_FANOUT;
+		std::sort(entries.begin(), entries.end(), byX);
+		for (size_t i = 0; i < entries.size(); i += per_slice)
+			std::sort(entries.begin() + i, entries.begin() + std::min(i + per_slice, entries.size()), byY);
+
+		levels.push_back(std::vector<rect>(entries.size()));
+		which.resize(entries.size());
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			levels[0][i] = entries[i].box;
+			which[i] = entries[i].pos;
+		}
+		while (levels.back().size() > 1)
+		{
+			const std::vector<rect> &below = levels.back();
+			std::vector<rect> above((below.size() + NODE_INDEX_FANOUT - 1) / NODE_INDEX_FANOUT);
+			for (size_t i = 0; i < below.size(); i++)
+			{
+				rect &box = above[i / NODE_INDEX_FANOUT];
+				if (!(i % NODE_INDEX_FANOUT))
+					box = below[i];
+				box.xmin = std::min(box.xmin, below[i].xmin);
+				box.ymin = std::min(box.ymin, below[i].ymin);
+				box.xmax = std::max(box.xmax, below[i].xmax);
+				box.ymax = std::max(box.ymax, below[i].ymax);
+			}
+			levels.push_back(above);
+		}
+	}
+	// Find every node whose bounding box touches the given rect, in the same order as they were in the list
+	void find (const rect &r, std::vector<size_t> &found) const
+	{
+		found.clear();
+		if (levels[0].size())
+			search(levels.size() - 1, 0, r, found);
+		std::sort(found.begin(), found.end());
+	}
+	// Find every node whose bounding box contains a point - only those can have the point inside them
+	void find (const vertex &v, std::vector<size_t> &found) const
+	{
+		rect r;
+		r.xmin = r.xmax = v.x;
+		r.ymin = r.ymax = v.y;
+		find(r, found);
+	}
+};
+
+// The contents of one layer file, read into memory ahead of being turned into nodes
+// (which means it can be done on another thread - see layer_loader below)
+struct layer_data
+{
+	bool ok;
+	// Anything which went wrong while reading it, to be printed once it's picked up
+	std::string errors;
+	// All of the file's vertices, with each ring's first vertex repeated at its end
+	std::vector<vertex> arena;
+	std::vector<polygon> polys;
+	std::vector<rect> bboxes;
+	layer_data () : ok(true) { }
+	void error (const char *before, const char *filename, const char *after)
+	{
+		errors += before;
+		errors += filename;
+		errors += after;
+		ok = false;
+	}
+};
+
+// Read a binary layer file (as described in polydat.h) which has already been mapped into memory
+void parse_layer_binary (const char *filename, const char *base, size_t size, layer_data &data)
+{
+	const polydat_header *hdr = (const polydat_header *)base;
+	bool ok = (size >= sizeof(polydat_header)) && (size == sizeof(polydat_header) + hdr->num_polys * sizeof(polydat_poly) + hdr->num_rings * sizeof(polydat_ring) + hdr->num_vertices * sizeof(polydat_vertex));
+	const polydat_poly *polys = (const polydat_poly *)(hdr + 1);
+	const polydat_ring *rings = (const polydat_ring *)(polys + (ok ? hdr->num_polys : 0));
+	const polydat_vertex *vertices = (const polydat_vertex *)(rings + (ok ? hdr->num_rings : 0));
+	std::vector<vertex> &arena = data.arena;
+	if (ok)
+	{
+		arena.reserve(hdr->num_vertices + hdr->num_rings);
+		data.polys.reserve(hdr->num_polys);
+		data.bboxes.reserve(hdr->num_polys);
+	}
+	for (uint32_t i = 0; ok && i < hdr->num_polys; i++)
+	{
+		const polydat_poly &rec = polys[i];
+		if (!rec.num_rings || rec.first_ring + rec.num_rings > hdr->num_rings)
+		{
+			ok = false;
+			break;
+		}
+		polygon poly;
+		for (uint32_t r = rec.first_ring; r < rec.first_ring + rec.num_rings; r++)
+		{
+			const polydat_ring &ring = rings[r];
+			// (rings used more than once would overflow the arena, moving everything already in it)
+			if (!ring.num_vertices || ring.first_vertex + ring.num_vertices > hdr->num_vertices || arena.size() + ring.num_vertices + 1 > arena.capacity())
+			{
+				ok = false;
+				break;
+			}
+			if (r != rec.first_ring)
+				poly.addHole();
+			size_t start = arena.size();
+#if defined(CHIP_HEIGHT) || (UPSCALE != 1)
+			for (uint32_t v = ring.first_vertex; v < ring.first_vertex + ring.num_vertices; v++)
+			{
+#ifdef	CHIP_HEIGHT
+				arena.push_back(vertex(vertices[v].x * UPSCALE, (CHIP_HEIGHT - vertices[v].y) * UPSCALE));
+#else
+				arena.push_back(vertex(vertices[v].x * UPSCALE, vertices[v].y * UPSCALE));
+#endif
+			}
+#else
+			const vertex *src = (const vertex *)&vertices[ring.first_vertex];
+			arena.insert(arena.end(), src, src + ring.num_vertices);
+#endif
+			arena.push_back(arena[start]);
+			poly.attach(&arena[start], ring.num_vertices + 1);
+		}
+		if (!ok)
+			break;
+		poly.classify();
+		rect bbox;
+#if defined(CHIP_HEIGHT) || (UPSCALE != 1)
+		poly.bRect(bbox);
+#else
+		// the bounding box was already worked out when the file was written
+		bbox.xmin = rec.xmin;
+		bbox.ymin = rec.ymin;
+		bbox.xmax = rec.xmax;
+		bbox.ymax = rec.ymax;
+#endif
+		data.polys.push_back(poly);
+		data.bboxes.push_back(bbox);
 	}
+	if (!ok)
+		data.error("File '", filename, "' is corrupt!\n");
+}
+
+// Reads "x,y" pairs from a text layer file in memory, exactly the way fscanf(in, "%d,%d") would -
+// including setting "eof" whenever it has to look past the end of the file, as feof() would be
+struct layer_scanner
+{
+	const char *pos, *end;
+	bool eof;
+	layer_scanner (const char *text, size_t size) : pos(text), end(text + size), eof(false) { }
+	int peek ()
+	{
+		if (pos == end)
+		{
+			eof = true;
+			return EOF;
+		}
+		return (unsigned char)*pos;
+	}
+	static bool digit (int c)
+	{
+		return (c >= '0') && (c <= '9');
+	}
+	bool number (int &out)
+	{
+		int c;
+		while (((c = peek()) == ' ') || ((c >= '\t') && (c <= '\r')))
+			pos++;
+		bool neg = (c == '-');
+		if ((c == '-') || (c == '+'))
+		{
+			pos++;
+			c = peek();
+		}
+		if (!digit(c))
+			return false;
+		// anything too big for a 64-bit long gets clamped, as strtol() would, before being cut down to an int
+		const uint64_t limit = (uint64_t)1 << 63;
+		uint64_t val = 0;
+		for (; digit(c); c = peek())
+		{
+			val = (val > limit / 10) ? limit : std::min(val * 10 + (c - '0'), limit);
+			pos++;
+		}
+		if (!neg && (val == limit))
+			val--;
+		out = (int)(neg ? 0 - val : val);
+		return true;
+	}
+	// Returns how many of the two numbers it read
+	int pair (int &x, int &y)
+	{
+		if (!number(x))
+			return 0;
+		if (peek() != ',')
+			return 1;
+		pos++;
+		if (!number(y))
+			return 1;
+		return 2;
+	}
+};
+
+// Where each ring read from a text layer file starts in its arena, and which polygon it belongs to
+struct pending_ring
+{
+	size_t poly;
+	size_t start;
+	bool hole;
+};
+
+// Finish the ring currently being read by copying its first vertex to the end, as polygon::finish() does
+void close_ring (std::vector<vertex> &arena, size_t start)
+{
+	arena.push_back((arena.size() > start) ? arena[start] : vertex());
+}
+
+// Once a text layer file has been read in, point each polygon at its rings
+// (which can't be done any sooner, since the arena moves around while it's growing)
+void attach_rings (layer_data &data, const std::vector<pending_ring> &rings)
+{
+	std::vector<vertex> &arena = data.arena;
+	for (size_t i = 0; i < rings.size(); i++)
+	{
+		size_t end = (i + 1 < rings.size()) ? rings[i + 1].start : arena.size();
+		polygon &poly = data.polys[rings[i].poly];
+		if (rings[i].hole)
+			poly.addHole();
+		poly.attach(&arena[rings[i].start], end - rings[i].start);
+	}
+	data.bboxes.resize(data.polys.size());
+	for (size_t i = 0; i < data.polys.size(); i++)
+	{
+		data.polys[i].classify();
+		data.polys[i].bRect(data.bboxes[i]);
+	}
+}
+
+// Read a text layer file which has already been mapped into memory
+void parse_layer_text (const char *filename, const char *text, size_t size, layer_data &data)
+{
+	layer_scanner in(text, size);
 	int x, y;
 	int r;
 	int line = 0;
-	T *n = new T;
+	std::vector<vertex> &arena = data.arena;
+	std::vector<pending_ring> rings;
+	// the number of complete polygons so far, the last of which ends just before the rings for the one being read
+	size_t polys = 0;
+	size_t poly_rings = 0;
+	pending_ring ring = { 0, 0, false };
+	rings.push_back(ring);
 	while (1)
 	{
 		line++;
-		r = fscanf(in, "%d,%d", &x, &y);
-		if (feof(in))
+		r = in.pair(x, y);
+		if (in.eof)
 			break;
 		if (r != 2)
 		{
-			fprintf(stderr, "Error reading from file '%s' at line %i!\n", filename, line);
-			delete n;
-			return false;
+			char buf[16];
+			sprintf(buf, "%i", line);
+			data.error("Error reading from file '", filename, (std::string("' at line ") + buf + "!\n").c_str());
+			break;
+		}
+		if ((x == -2) && (y == -2))
+		{
+			// the following vertices describe a hole in the current polygon
+			close_ring(arena, rings.back().start);
+			pending_ring hole = { polys, arena.size(), true };
+			rings.push_back(hole);
 		}
-		if ((x == -1) && (y == -1))
+		else if ((x == -1) && (y == -1))
 		{
-			n->poly.finish();
-			n->layer = layer;
-			if (force_id != -1)
-				n->id = force_id;
-			n->poly.bRect(n->bbox);
-			nodes.push_back(n);
-			n = new T;
+			close_ring(arena, rings.back().start);
+			polys++;
+			pending_ring next = { polys, arena.size(), false };
+			poly_rings = rings.size();
+			rings.push_back(next);
 		}
 		else
 		{
@@ -366,14 +1332,172 @@ bool readnodes (const char *filename, std::vector<T *> &nodes, int layer, int fo
 			// (0,0 is at bottom-left instead of top-left)
 			// we flip the image vertically
 #ifdef	CHIP_HEIGHT
-			n->poly.add(x * UPSCALE, (CHIP_HEIGHT - y) * UPSCALE);
+			arena.push_back(vertex(x * UPSCALE, (CHIP_HEIGHT - y) * UPSCALE));
 #else
-			n->poly.add(x * UPSCALE, y * UPSCALE);
+			arena.push_back(vertex(x * UPSCALE, y * UPSCALE));
 #endif
 		}
 	}
-	delete n;
-	return true;
+	// throw away whatever was left over after the last complete polygon
+	arena.resize(rings[poly_rings].start);
+	rings.resize(poly_rings);
+	data.polys.resize(polys);
+	attach_rings(data, rings);
+}
+
+// Read a layer file (binary or text) into memory, mapping it directly where possible
+void load_layer (const char *filename, layer_data &data)
+{
+	FILE *in = fopen(filename, "rb");
+	if (!in)
+	{
+		data.error("Failed to open file '", filename, "'!\n");
+		return;
+	}
+	fseek(in, 0, SEEK_END);
+	size_t size = ftell(in);
+	// (empty files can't be mapped, but there's nothing in them to read anyway)
+	const char *base = "";
+#ifdef _MSC_VER
+	std::vector<char> buf(size + 1);
+	rewind(in);
+	if (fread(&buf[0], 1, size, in) != size)
+	{
+		data.error("Error reading from file '", filename, "'!\n");
+		fclose(in);
+		return;
+	}
+	base = &buf[0];
+#else
+	void *map = NULL;
+	if (size)
+	{
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+		if (map == MAP_FAILED)
+		{
+			data.error("Error reading from file '", filename, "'!\n");
+			fclose(in);
+			return;
+		}
+		base = (const char *)map;
+	}
+#endif
+	fclose(in);
+
+	// Binary layer files start with a header, while text ones start with a vertex
+	if ((size >= sizeof(polydat_magic)) && !memcmp(base, polydat_magic, sizeof(polydat_magic)))
+		parse_layer_binary(filename, base, size, data);
+	else	parse_layer_text(filename, base, size, data);
+
+#ifndef _MSC_VER
+	if (map)
+		munmap(map, size);
+#endif
+}
+
+// Turn the polygons read from a layer file into nodes, reporting anything which went wrong while reading it
+template<class T>
+bool add_nodes (layer_data &data, std::vector<T *> &nodes, int layer, int force_id)
+{
+	fputs(data.errors.c_str(), stderr);
+	// the arena's storage moves over with it, so the polygons still point at the right place
+	vertex_arenas().push_back(std::vector<vertex>());
+	vertex_arenas().back().swap(data.arena);
+	for (size_t i = 0; i < data.polys.size(); i++)
+	{
+		T *n = new T;
+		n->poly = data.polys[i];
+		n->bbox = data.bboxes[i];
+		n->layer = layer;
+		if (force_id != -1)
+			n->id = force_id;
+		nodes.push_back(n);
+	}
+	data.polys.clear();
+	data.bboxes.clear();
+	return data.ok;
+}
+
+// Read vertex list for a particular layer and generate node definitions
+template<class T>
+bool readnodes (const char *filename, std::vector<T *> &nodes, int layer, int force_id = -1)
+{
+	printf("Reading file: %s\n", filename);
+	layer_data data;
+	load_layer(filename, data);
+	return add_nodes(data, nodes, layer, force_id);
 }
 
+// Reads a whole list of layer files at once on a pool of threads, so they're ready by the time
+// read() gets asked for each of them - which then does exactly what readnodes() would have done
+// (files which weren't in the list just get read there and then)
+class layer_loader
+{
+	struct pending_file
+	{
+		std::string filename;
+		layer_data data;
+		bool done, taken;
+	};
+	std::vector<pending_file> files;
+	std::vector<std::thread> threads;
+	std::atomic<size_t> next;
+	std::mutex lock;
+	std::condition_variable ready;
+
+	void work ()
+	{
+		size_t i;
+		while ((i = next++) < files.size())
+		{
+			load_layer(files[i].filename.c_str(), files[i].data);
+			std::lock_guard<std::mutex> hold(lock);
+			files[i].done = true;
+			ready.notify_all();
+		}
+	}
+public:
+	// With no number of threads given, use one per CPU
+	layer_loader (const char *const *filenames, size_t count, int workers = 0) : next(0)
+	{
+		if (workers <= 0)
+			workers = std::thread::hardware_concurrency();
+		workers = (int)std::min((size_t)workers, count);
+		// with only one thread, they'd just be read in order anyway, so leave them until they're asked for
+		if (workers < 2)
+			return;
+		files.resize(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			files[i].filename = filenames[i];
+			files[i].done = files[i].taken = false;
+		}
+		for (int i = 0; i < workers; i++)
+			threads.push_back(std::thread(&layer_loader::work, this));
+	}
+	~layer_loader ()
+	{
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+	}
+	template<class T>
+	bool read (const char *filename, std::vector<T *> &nodes, int layer, int force_id = -1)
+	{
+		for (size_t i = 0; i < files.size(); i++)
+		{
+			if (files[i].taken || (files[i].filename != filename))
+				continue;
+			printf("Reading file: %s\n", filename);
+			{
+				std::unique_lock<std::mutex> hold(lock);
+				while (!files[i].done)
+					ready.wait(hold);
+			}
+			files[i].taken = true;
+			return add_nodes(files[i].data, nodes, layer, force_id);
+		}
+		return readnodes(filename, nodes, layer, force_id);
+	}
+};
+
 #endif // POLYGON_H